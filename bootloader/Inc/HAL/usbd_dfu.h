@@ -185,6 +185,9 @@ typedef struct
   uint16_t (* Write)(uint8_t *src, uint8_t *dest, uint32_t Len);
   uint8_t *(* Read)(uint8_t *src, uint8_t *dest, uint32_t Len);
   uint16_t (* GetStatus)(uint32_t Add, uint8_t cmd, uint8_t *buff);
+  uint16_t (* Manifest)(void); /* optional, checks the download before leaving */
+  uint8_t *(* Vendor)(USBD_SetupReqTypedef *req, uint16_t *len); /* optional, device to host vendor requests */
+  uint32_t (* WriteTime)(uint8_t *src, uint8_t *dest, uint32_t Len); /* optional, bwPollTimeout in ms for a Write */
 } USBD_DFU_MediaTypeDef;
 /**
   * @}
@@ -0,0 +1,64 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// bootloader -> app handoff, written by the bootloader right before it jumps.
+// lives in the last 32 bytes of DTCM, which both linker scripts keep out of
+// RAM so neither stack nor bss touches it and the startup doesn't clear it.
+// keep this file identical in bootloader/Inc and mouse/Inc.
+#define HANDOFF_ADDR 0x2000FFE0
+#define HANDOFF_MAX 32
+#define HANDOFF ((volatile Handoff *) HANDOFF_ADDR)
+
+#define HANDOFF_MAGIC 0x4D334B48 // "M3KH"
+#define HANDOFF_VERSION 1 // bump on changes, only ever append fields
+
+enum {
+	HANDOFF_REASON_NORMAL, // RMB not held
+	HANDOFF_REASON_BOTH, // LMB and RMB held, straight to the app
+	HANDOFF_REASON_RMB, // RMB held and released before the DFU timeout
+};
+
+#define HANDOFF_BTN_LMB (1 << 0)
+#define HANDOFF_BTN_RMB (1 << 1)
+
+#define HANDOFF_CLOCK_HSE_ON (1 << 0) // HSE started, HSERDY may still be low
+
+typedef struct {
+	uint32_t magic; // HANDOFF_MAGIC, the app clears it once read
+	uint8_t version; // HANDOFF_VERSION
+	uint8_t size; // sizeof(Handoff) of the writer
+	uint8_t reason; // HANDOFF_REASON_*
+	uint8_t buttons; // HANDOFF_BTN_* at bootloader entry
+	uint32_t reset; // RCC->CSR reset flags, the bootloader clears them
+	uint32_t hclk; // sysclk while in the bootloader, in Hz
+	uint8_t clock; // HANDOFF_CLOCK_*, sysclk is still HSI. SysTick is off but for HANDOFF_REASON_RMB
+	uint8_t _pad[3];
+	uint32_t entry_cycles; // DWT when the bootloader started it in main
+	uint32_t jump_cycles; // DWT right before the jump
+} Handoff;
+
+_Static_assert(sizeof(Handoff) <= HANDOFF_MAX, "handoff block too large");
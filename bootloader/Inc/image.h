@@ -0,0 +1,56 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "usbd_conf.h"
+#include "usbd_dfu_flash.h"
+
+// application image in sectors 2-3, ending in a row of trailer slots that
+// the mouse linker script keeps free. the DFU backend appends a slot at
+// manifest, the bootloader checks the last one before every jump.
+#define IMAGE_START USBD_DFU_APP_DEFAULT_ADD
+#define IMAGE_END ADDR_FLASH_SECTOR_4
+#define IMAGE_SLOTS 16
+#define IMAGE_TRAILER (IMAGE_END - IMAGE_SLOTS * sizeof(Image_trailer))
+
+#define IMAGE_MAGIC 0x494D4731 // "IMG1"
+
+typedef struct {
+	uint32_t magic; // IMAGE_MAGIC, all 0 voids everything before it
+	uint32_t length; // bytes from IMAGE_START, multiple of 4
+	uint32_t crc; // CRC unit defaults: poly 0x04C11DB7, init ~0, word input
+	uint32_t check; // ~crc
+} Image_trailer;
+
+enum {
+	IMAGE_OK, // last slot valid and the CRC matches
+	IMAGE_LEGACY, // no slots written yet, the vector table looks sane
+	IMAGE_BAD, // slot voided, torn or the CRC doesn't match
+};
+
+int image_check(void);
+uint32_t image_crc(uint32_t length);
+const Image_trailer *image_last(void);
+Image_trailer *image_next(void);
@@ -66,7 +66,7 @@
 
 /* DFU Class Config */
 #define USBD_DFU_MAX_ITF_NUM                   1
-#define USBD_DFU_XFER_SIZE                     1024   /* Max DFU Packet Size = 1024 bytes */
+#define USBD_DFU_XFER_SIZE                     4096   /* Max DFU Packet Size = 4096 bytes, the Linux usbfs control limit */
 #define USBD_DFU_APP_DEFAULT_ADD               0x08008000 /* The first 2 sectors (32 KB) are reserved for DFU code */
 #define USBD_DFU_MAX_NB_OF_SECTORS             8 /* Max number of sectors */
 
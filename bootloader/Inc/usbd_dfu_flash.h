@@ -63,7 +63,23 @@
 #define ADDR_FLASH_SECTOR_7     ((uint32_t)0x08060000) /* Base @ of Sector 7, 128 Kbytes */
 
 /* Exported macro ------------------------------------------------------------*/
+/* Download counters since reset, blocks are DFU transfers */
+typedef struct
+{
+  uint32_t erased;           /* sectors erased */
+  uint32_t programmed;       /* blocks that differed from flash */
+  uint32_t skipped;          /* blocks identical to flash, not touched */
+  uint32_t words_programmed;
+  uint32_t words_skipped;    /* identical words within programmed blocks, too */
+} Flash_Stats;
+
+/* Vendor requests, device to host, recipient device */
+#define FLASH_VENDOR_CRC    0x01U /* wValue: start in words from 0x08000000, wIndex: length in words.
+                                     Returns the uint32_t CRC as the image trailer computes it */
+#define FLASH_VENDOR_STATS  0x02U /* Returns Flash_Stats */
+
 extern USBD_DFU_MediaTypeDef  USBD_DFU_Flash_fops;
+extern Flash_Stats flash_stats;
 
 /* Exported functions ------------------------------------------------------- */
 
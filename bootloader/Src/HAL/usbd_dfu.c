@@ -211,7 +211,7 @@ __ALIGN_BEGIN static uint8_t USBD_DFU_CfgDesc[USB_DFU_CONFIG_DESC_SIZ] __ALIGN_E
   0x00,
   /* WARNING: In DMA mode the multiple MPS packets feature is still not supported
    ==> In this case, when using DMA USBD_DFU_XFER_SIZE should be set to 64 in usbd_conf.h */
-  TRANSFER_SIZE_BYTES(USBD_DFU_XFER_SIZE),       /* TransferSize = 1024 Byte */
+  TRANSFER_SIZE_BYTES(USBD_DFU_XFER_SIZE),       /* TransferSize = USBD_DFU_XFER_SIZE */
   0x1A,                                /* bcdDFUVersion */
   0x01
   /***********************************************************/
@@ -332,6 +332,7 @@ static uint8_t USBD_DFU_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 static uint8_t USBD_DFU_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 {
   USBD_DFU_HandleTypeDef *hdfu = (USBD_DFU_HandleTypeDef *)pdev->pClassData;
+  USBD_DFU_MediaTypeDef *DfuInterface = (USBD_DFU_MediaTypeDef *)pdev->pUserData;
   USBD_StatusTypeDef ret = USBD_OK;
   uint8_t *pbuf = NULL;
   uint16_t len = 0U;
@@ -445,6 +446,23 @@ static uint8_t USBD_DFU_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
     }
     break;
 
+  case USB_REQ_TYPE_VENDOR:
+    if ((DfuInterface->Vendor != NULL) && ((req->bmRequest & 0x80U) != 0U))
+    {
+      pbuf = DfuInterface->Vendor(req, &len);
+    }
+
+    if (pbuf != NULL)
+    {
+      (void)USBD_CtlSendData(pdev, pbuf, MIN(len, req->wLength));
+    }
+    else
+    {
+      USBD_CtlError(pdev, req);
+      ret = USBD_FAIL;
+    }
+    break;
+
   default:
     USBD_CtlError(pdev, req);
     ret = USBD_FAIL;
@@ -882,6 +900,15 @@ static void DFU_GetStatus(USBD_HandleTypeDef *pdev)
       else
       {
         DfuInterface->GetStatus(hdfu->data_ptr, DFU_MEDIA_PROGRAM, hdfu->dev_status);
+        if ((DfuInterface->WriteTime != NULL) && (hdfu->wblock_num > 1U))
+        {
+          /* The block is in the buffer already, the media can tell what writing it takes */
+          const uint32_t ms = DfuInterface->WriteTime(hdfu->buffer.d8,
+              (uint8_t *)(((hdfu->wblock_num - 2U) * USBD_DFU_XFER_SIZE) + hdfu->data_ptr), hdfu->wlength);
+          hdfu->dev_status[1] = (uint8_t)ms;
+          hdfu->dev_status[2] = (uint8_t)(ms >> 8);
+          hdfu->dev_status[3] = (uint8_t)(ms >> 16);
+        }
       }
     }
     else  /* (hdfu->wlength==0)*/
@@ -896,7 +923,20 @@ static void DFU_GetStatus(USBD_HandleTypeDef *pdev)
     break;
 
   case DFU_STATE_MANIFEST_SYNC:
-    if (hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS)
+    if ((hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS) &&
+        (DfuInterface->Manifest != NULL) && (DfuInterface->Manifest() != USBD_OK))
+    {
+      /* Download didn't verify, stay in DFU so the host can retry */
+      hdfu->manif_state = DFU_MANIFEST_COMPLETE;
+      hdfu->dev_state = DFU_STATE_ERROR;
+
+      hdfu->dev_status[0] = DFU_ERROR_VERIFY;
+      hdfu->dev_status[1] = 0U;
+      hdfu->dev_status[2] = 0U;
+      hdfu->dev_status[3] = 0U;
+      hdfu->dev_status[4] = hdfu->dev_state;
+    }
+    else if (hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS)
     {
       hdfu->dev_state = DFU_STATE_MANIFEST;
 
@@ -0,0 +1,84 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "image.h"
+#include "stm32f7xx.h"
+
+#define IMAGE_BLANK 0xFFFFFFFF
+
+static const Image_trailer *const slots = (const Image_trailer *) IMAGE_TRAILER;
+
+// last slot that has been written to, NULL if none
+const Image_trailer *image_last(void)
+{
+	for (int i = IMAGE_SLOTS - 1; i >= 0; i--)
+		if (slots[i].magic != IMAGE_BLANK)
+			return &slots[i];
+	return NULL;
+}
+
+// first blank slot after the last written one, NULL if full
+Image_trailer *image_next(void)
+{
+	const Image_trailer *last = image_last();
+	const Image_trailer *next = last == NULL ? slots : last + 1;
+	return next < slots + IMAGE_SLOTS ? (Image_trailer *) next : NULL;
+}
+
+// CRC of the image's first length bytes through the CRC unit, 1 word per
+// cycle or so. leaves the unit reset.
+uint32_t image_crc(const uint32_t length)
+{
+	const uint32_t *p = (const uint32_t *) IMAGE_START;
+	const uint32_t *end = p + length / 4;
+	CRC->CR = CRC_CR_RESET;
+	while (p < end)
+		CRC->DR = *p++;
+	const uint32_t crc = CRC->DR;
+	CRC->CR = CRC_CR_RESET;
+	return crc;
+}
+
+int image_check(void)
+{
+	const Image_trailer *t = image_last();
+	if (t == NULL) {
+		// flashed before trailers existed. only refuse an obviously empty app.
+		const uint32_t sp = ((const uint32_t *) IMAGE_START)[0];
+		const uint32_t pc = ((const uint32_t *) IMAGE_START)[1];
+		if (sp < 0x20000000 || sp > 0x20010000 || pc < IMAGE_START || pc >= IMAGE_TRAILER)
+			return IMAGE_BAD;
+		return IMAGE_LEGACY;
+	}
+	if (t->magic != IMAGE_MAGIC || t->crc != ~t->check
+			|| t->length == 0 || t->length > IMAGE_TRAILER - IMAGE_START || t->length % 4)
+		return IMAGE_BAD;
+
+	const int crc_on = (RCC->AHB1ENR & RCC_AHB1ENR_CRCEN) != 0;
+	RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+	__DSB();
+	const uint32_t crc = image_crc(t->length);
+	if (!crc_on)
+		RCC->AHB1ENR &= ~RCC_AHB1ENR_CRCEN;
+	return crc == t->crc ? IMAGE_OK : IMAGE_BAD;
+}
@@ -46,6 +46,8 @@
 /* Includes ------------------------------------------------------------------*/
 #include <m3k_resource.h>
 #include "main.h"
+#include "handoff.h"
+#include "image.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -59,6 +61,7 @@ uint32_t JumpAddress;
 /* Private function prototypes -----------------------------------------------*/
 static void SystemClock_Config(void);
 static void Error_Handler(void);
+static void jump_to_app(uint8_t reason, uint8_t buttons, uint32_t entry_cycles);
 //static void CPU_CACHE_Enable(void);
 
 /* Private functions ---------------------------------------------------------*/
@@ -69,6 +72,17 @@ static void Error_Handler(void);
  * @retval None
  */
 int main(void) {
+	// timestamps for the handoff. DWT survives a system reset, so restart it.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	const uint32_t entry_cycles = DWT->CYCCNT;
+
+	// start the crystal now, it settles while we look at the buttons and
+	// the app's clk_init finds it ready. SystemClock_Config is fine with it.
+	RCC->CR |= RCC_CR_HSEON;
+
 	RMB_NO_CLK_ENABLE();
 	LMB_NO_CLK_ENABLE();
 
@@ -87,40 +101,36 @@ int main(void) {
 	__NOP();
 	__NOP();
 
-	// RMB not pressed, or both LMB and RMB are pressed
-	if ((RMB_NO_PORT->IDR & RMB_NO_PIN) != 0
-			|| ((RMB_NO_PORT->IDR & RMB_NO_PIN) == 0
-					&& (LMB_NO_PORT->IDR & LMB_NO_PIN) == 0)) {
-		// jump to app
-		JumpAddress = *(__IO uint32_t*) (USBD_DFU_APP_DEFAULT_ADD + 4);
-		JumpToApplication = (pFunction) JumpAddress;
-		__set_MSP(*(__IO uint32_t*) USBD_DFU_APP_DEFAULT_ADD);
-		JumpToApplication();
-	}
+	uint8_t buttons = 0;
+	if ((LMB_NO_PORT->IDR & LMB_NO_PIN) == 0)
+		buttons |= HANDOFF_BTN_LMB;
+	if ((RMB_NO_PORT->IDR & RMB_NO_PIN) == 0)
+		buttons |= HANDOFF_BTN_RMB;
 
-	// RMB pressed. continue to DFU mode if held for DFU_TIMEOUT seconds.
-	// default HSI clock is 16MHz. set SysTick to reload every 1ms.
-	SysTick->LOAD = (16000000 / 1000) - 1;
-	SysTick->VAL = 0;
-	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
-
-	for (int i = 0; i < DFU_TIMEOUT * 1000; i++) { // loops every 1ms
-		while ((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) == 0) {
-			if ((RMB_NO_PORT->IDR & RMB_NO_PIN) != 0) { // RMB released
-				// keep SysTick enabled. application will know from this that
-				// both LMB and RMB were originally pressed.
-				JumpAddress = *(__IO uint32_t*) (USBD_DFU_APP_DEFAULT_ADD + 4);
-
-				JumpToApplication = (pFunction) JumpAddress;
-				__set_MSP(*(__IO uint32_t*) USBD_DFU_APP_DEFAULT_ADD);
-				JumpToApplication();
+	// interrupted or corrupt download: straight to DFU, whatever the buttons
+	if (image_check() != IMAGE_BAD) {
+		// RMB not pressed, or both LMB and RMB are pressed
+		if (buttons != HANDOFF_BTN_RMB)
+			jump_to_app(buttons == 0 ? HANDOFF_REASON_NORMAL : HANDOFF_REASON_BOTH,
+					buttons, entry_cycles);
+
+		// RMB pressed. continue to DFU mode if held for DFU_TIMEOUT seconds.
+		// default HSI clock is 16MHz. set SysTick to reload every 1ms.
+		SysTick->LOAD = (HSI_VALUE / 1000) - 1;
+		SysTick->VAL = 0;
+		SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+		for (int i = 0; i < DFU_TIMEOUT * 1000; i++) { // loops every 1ms
+			while ((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) == 0) {
+				if ((RMB_NO_PORT->IDR & RMB_NO_PIN) != 0) // RMB released
+					jump_to_app(HANDOFF_REASON_RMB, buttons, entry_cycles);
 			}
 		}
 	}
 
 	HAL_Init();
 
-	/* Configure the System clock to have a frequency of 216 MHz */
+	/* Configure the System clock to have a frequency of 96 MHz */
 	SystemClock_Config();
 
 	/* Init Device Library */
@@ -141,6 +151,42 @@ int main(void) {
 	}
 }
 
+/**
+ * @brief  Fill in the handoff block and start the application
+ * @param  reason: HANDOFF_REASON_*
+ * @param  buttons: HANDOFF_BTN_* at entry
+ * @param  entry_cycles: DWT at entry
+ * @retval None
+ */
+static void jump_to_app(uint8_t reason, uint8_t buttons, uint32_t entry_cycles) {
+	// the reason says why we waited. apps from before the handoff only know
+	// SysTick left running as the RMB config reset, so it stays on for that.
+	if (reason != HANDOFF_REASON_RMB)
+		SysTick->CTRL = 0;
+
+	volatile Handoff *h = HANDOFF;
+	h->magic = 0; // not valid until complete
+	h->version = HANDOFF_VERSION;
+	h->size = sizeof(Handoff);
+	h->reason = reason;
+	h->buttons = buttons;
+	h->reset = RCC->CSR & (RCC_CSR_BORRSTF | RCC_CSR_PINRSTF | RCC_CSR_PORRSTF
+			| RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF);
+	RCC->CSR |= RCC_CSR_RMVF;
+	h->hclk = HSI_VALUE;
+	h->clock = HANDOFF_CLOCK_HSE_ON;
+	h->entry_cycles = entry_cycles;
+	h->jump_cycles = DWT->CYCCNT;
+	__DMB();
+	h->magic = HANDOFF_MAGIC;
+	__DSB();
+
+	JumpAddress = *(__IO uint32_t*) (USBD_DFU_APP_DEFAULT_ADD + 4);
+	JumpToApplication = (pFunction) JumpAddress;
+	__set_MSP(*(__IO uint32_t*) USBD_DFU_APP_DEFAULT_ADD);
+	JumpToApplication();
+}
+
 /**
  * @brief This function provides accurate delay (in milliseconds) based
  *        on SysTick counter flag.
@@ -162,19 +208,21 @@ void HAL_Delay(__IO uint32_t Delay) {
  * @brief  System Clock Configuration
  *         The system Clock is configured as follow :
  *            System Clock source            = PLL (HSE)
- *            SYSCLK(Hz)                     = 32000000
- *            HCLK(Hz)                       = 32000000
+ *            SYSCLK(Hz)                     = 96000000
+ *            HCLK(Hz)                       = 96000000
  *            AHB Prescaler                  = 1
- *            APB1 Prescaler                 = 4
- *            APB2 Prescaler                 = 2
+ *            APB1 Prescaler                 = 2
+ *            APB2 Prescaler                 = 1
  *            HSE Frequency(Hz)              = 24000000
  *            PLL_M                          = 12
  *            PLL_N                          = 96
- *            PLL_P                          = 6
+ *            PLL_P                          = 2
  *            PLL_Q                          = 4
  *            VDD(V)                         = 3.3
  *            Main regulator output voltage  = Scale1 mode
- *            Flash Latency(WS)              = 1
+ *            Flash Latency(WS)              = 3
+ *         DFU runs 3x faster than the app's 32MHz, which keeps the USB
+ *         interrupt and the programming loop short. PLL_Q still gives 48MHz.
  * @param  None
  * @retval None
  */
@@ -190,7 +238,7 @@ void SystemClock_Config(void) {
 	RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
 	RCC_OscInitStruct.PLL.PLLM = 12;
 	RCC_OscInitStruct.PLL.PLLN = 96;
-	RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV6;
+	RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
 	RCC_OscInitStruct.PLL.PLLQ = 4;
 	if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
 		Error_Handler();
@@ -208,9 +256,9 @@ void SystemClock_Config(void) {
 			| RCC_CLOCKTYPE_PCLK1 | RCC_CLOCKTYPE_PCLK2);
 	RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
 	RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
-	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV4;
-	RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV2;
-	if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_1) != HAL_OK) {
+	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV2;
+	RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+	if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_3) != HAL_OK) {
 		Error_Handler();
 	}
 }
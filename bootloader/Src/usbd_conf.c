@@ -347,7 +347,9 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   hpcd.Init.lpm_enable = 0; 
   hpcd.Init.phy_itface = USB_OTG_HS_EMBEDDED_PHY; 
   hpcd.Init.Sof_enable = 0;
-  hpcd.Init.speed = PCD_SPEED_HIGH_IN_FULL;
+  /* Chirps for high speed and drops to full speed by itself behind a full
+  speed hub or host. HAL_PCD_ResetCallback reports what was negotiated. */
+  hpcd.Init.speed = PCD_SPEED_HIGH;
   hpcd.Init.vbus_sensing_enable = 0;
   
   /* Link The driver to the stack */
@@ -357,8 +359,11 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   /* Initialize LL Driver */
   HAL_PCD_Init(&hpcd);
   
-  HAL_PCDEx_SetRxFiFo(&hpcd, 0x200);
-  HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x200); 
+  /* 4KB of FIFO RAM in words. EP0 packets are 64 bytes at either speed, so
+  TX only needs a few. The rest goes to RX, which also takes the SETUP and
+  status entries and absorbs DNLOAD data while the core is NAKing. */
+  HAL_PCDEx_SetRxFiFo(&hpcd, 0x380);
+  HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x80); 
 #endif 
   
   return USBD_OK;
@@ -46,17 +46,58 @@
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_dfu_flash.h"
 #include "stm32f7xx_hal_conf.h"
+#include "image.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 #define FLASH_DESC_STR      "@Internal Flash   /0x08000000/02*016Ka,02*016Kg,01*64Kg,03*128Kg"
 #define FLASH_ERASE_TIME    (uint16_t)50
-#define FLASH_PROGRAM_TIME  (uint16_t)50
+#define FLASH_WORD_US       16U /* typical 32-bit program time */
+#define FLASH_PROGRAM_TIME  (uint16_t)((USBD_DFU_XFER_SIZE / 4U * FLASH_WORD_US + 999U) / 1000U)
+#define FLASH_SECTOR_ERASE_TIME 250U /* typical 16 KB sector erase, x32 */
+
+/* The application image span. Erases there are deferred until a block
+   actually differs from what is in flash, see Flash_If_Write. */
+#define FLASH_APP_START     IMAGE_START
+#define FLASH_APP_END       IMAGE_END
+#define FLASH_APP_SECTOR    (ADDR_FLASH_SECTOR_3 - ADDR_FLASH_SECTOR_2)
+/* Sector_Erase: the erase, and programming back up to all of the sector */
+#define FLASH_SECTOR_TIME   (FLASH_SECTOR_ERASE_TIME + (FLASH_APP_SECTOR / 4U * FLASH_WORD_US + 999U) / 1000U)
+
+/* What Flash_If_Write has to do for a block */
+enum
+{
+  BLOCK_SAME,  /* nothing, it is in flash already */
+  BLOCK_BLANK, /* program it */
+  BLOCK_ERASE, /* erase first, flash only programs erased words */
+};
                                                              
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
+Flash_Stats flash_stats;
+
+/* Sectors that are blank since we erased them, bit per FLASH_SECTOR_x */
+static uint32_t erased;
+/* Programmed words also went through the CRC unit. The span they landed in is
+   read back through it once, at manifest or when the host jumps elsewhere. */
+static uint32_t verify_start, verify_end;
+/* Application data received this session, image_end is 0 if none. The
+   image trailer is voided before the first change and filled at manifest. */
+static uint32_t image_start, image_end;
+static uint8_t image_voided;
+/* What an app sector erase has to put back */
+static uint32_t sector_copy[FLASH_APP_SECTOR / 4U];
+
 /* Private function prototypes -----------------------------------------------*/
 static uint32_t GetSector(uint32_t Address);
+static uint32_t GetSectorMask(uint32_t Start, uint32_t End);
+static uint16_t Flash_Program(uint32_t *dest, const uint32_t *src, uint32_t words, uint8_t crc);
+static uint16_t Flash_Verify(void);
+static uint16_t Image_Void(void);
+static uint16_t Sector_Erase(uint32_t Base, uint32_t KeepStart, uint32_t KeepEnd);
+static uint32_t Flash_Crc(const uint32_t *start, uint32_t words);
+static uint8_t Block_Kind(const uint32_t *src, const uint32_t *dest, uint32_t words);
+static uint8_t Image_Full(void);
 
 /* Extern function prototypes ------------------------------------------------*/
 uint16_t Flash_If_Init(void);
@@ -65,6 +106,9 @@ uint16_t Flash_If_Write(uint8_t *src, uint8_t *dest, uint32_t Len);
 uint8_t *Flash_If_Read(uint8_t *src, uint8_t *dest, uint32_t Len);
 uint16_t Flash_If_DeInit(void);
 uint16_t Flash_If_GetStatus(uint32_t Add, uint8_t Cmd, uint8_t *buffer);
+uint16_t Flash_If_Manifest(void);
+uint8_t *Flash_If_Vendor(USBD_SetupReqTypedef *req, uint16_t *len);
+uint32_t Flash_If_WriteTime(uint8_t *src, uint8_t *dest, uint32_t Len);
 
 USBD_DFU_MediaTypeDef USBD_DFU_Flash_fops= {
   (uint8_t *)FLASH_DESC_STR,
@@ -74,6 +118,9 @@ USBD_DFU_MediaTypeDef USBD_DFU_Flash_fops= {
   Flash_If_Write,
   Flash_If_Read,
   Flash_If_GetStatus,  
+  Flash_If_Manifest,
+  Flash_If_Vendor,
+  Flash_If_WriteTime,
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -86,6 +133,13 @@ uint16_t Flash_If_Init(void)
 { 
   /* Unlock the internal flash */  
   HAL_FLASH_Unlock();
+
+  erased = 0;
+  verify_start = verify_end = 0;
+  image_start = image_end = 0;
+  image_voided = 0;
+  __HAL_RCC_CRC_CLK_ENABLE();
+  CRC->CR = CRC_CR_RESET;
   return 0;
 }
 
@@ -114,8 +168,20 @@ uint16_t Flash_If_Erase(uint32_t Add)
   HAL_StatusTypeDef status;
   FLASH_EraseInitTypeDef eraseinitstruct;
   
+  if ((Add >= FLASH_APP_START) && (Add < FLASH_APP_END))
+  {
+    /* Deferred, most of an update is usually identical to what is there */
+    return 0;
+  }
+
   /* Get the number of sector */
   startsector = GetSector(Add);
+  if ((erased & (1U << startsector)) != 0U)
+  {
+    /* Erased before and not written since */
+    return 0;
+  }
+
   eraseinitstruct.TypeErase = FLASH_TYPEERASE_SECTORS;
   eraseinitstruct.Sector = startsector;
   eraseinitstruct.NbSectors = 1;
@@ -126,6 +192,8 @@ uint16_t Flash_If_Erase(uint32_t Add)
   {
     return 1;
   }
+  erased |= 1U << startsector;
+  flash_stats.erased++;
   return 0;
 }
 
@@ -138,27 +206,86 @@ uint16_t Flash_If_Erase(uint32_t Add)
   */
 uint16_t Flash_If_Write(uint8_t *src, uint8_t *dest, uint32_t Len)
 {
-  uint32_t i = 0;
-  
-  for(i = 0; i < Len; i+=4)
+  const uint32_t words = (Len + 3U) / 4U;
+  const uint32_t end = (uint32_t)dest + words * 4U;
+  const uint32_t *s = (const uint32_t *)src;
+  const uint32_t *d = (const uint32_t *)dest;
+  uint32_t i, base;
+  uint8_t kind;
+  const uint8_t app = ((uint32_t)dest >= FLASH_APP_START) && ((uint32_t)dest < FLASH_APP_END);
+
+  if (app)
   {
-    /* Device voltage range supposed to be [2.7V to 3.6V], the operation will
-       be done by byte */ 
-    if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)(dest+i), *(uint32_t*)(src+i)) == HAL_OK)
+    if (end > IMAGE_TRAILER)
     {
-     /* Check the written value */
-      if(*(uint32_t *)(src + i) != *(uint32_t*)(dest+i))
-      {
-        /* Flash content doesn't match SRAM content */
-        return 2;
-      }
+      /* Image too large, it would run into the trailer slots */
+      return 1;
+    }
+    if ((image_end == 0U) || ((uint32_t)dest < image_start))
+    {
+      image_start = (uint32_t)dest;
+    }
+    if (end > image_end)
+    {
+      image_end = end;
+    }
+  }
+
+  if ((uint32_t)dest != verify_end)
+  {
+    /* Not a continuation, check what we have so far and start a new span */
+    if (Flash_Verify() != 0U)
+    {
+      return 2;
     }
-    else
+    verify_start = verify_end = (uint32_t)dest;
+  }
+  verify_end += words * 4U;
+
+  kind = Block_Kind(s, d, words);
+  if (kind == BLOCK_SAME)
+  {
+    for (i = 0; i < words; i++)
+    {
+      CRC->DR = s[i];
+    }
+    flash_stats.skipped++;
+    flash_stats.words_skipped += words;
+    return 0;
+  }
+
+  if (app)
+  {
+    if (Image_Void() != 0U)
     {
-      /* Error occurred while writing data in Flash memory */
       return 1;
     }
+    if (kind == BLOCK_ERASE)
+    {
+      /* Erase, putting back what this download already went through */
+      for (base = FLASH_APP_START + ((uint32_t)dest - FLASH_APP_START) / FLASH_APP_SECTOR * FLASH_APP_SECTOR;
+           base < end; base += FLASH_APP_SECTOR)
+      {
+        if (Sector_Erase(base, (image_start > base) ? image_start : base, (uint32_t)dest) != 0U)
+        {
+          return 1;
+        }
+      }
+    }
   }
+  else if (kind == BLOCK_ERASE)
+  {
+    /* Not erased, the host skipped the erase command */
+    return 1;
+  }
+
+  erased &= ~GetSectorMask((uint32_t)dest, end);
+  if (Flash_Program((uint32_t *)dest, s, words, 1U) != 0U)
+  {
+    /* Error occurred while writing data in Flash memory */
+    return 1;
+  }
+  flash_stats.programmed++;
   return 0;
 }
 
@@ -171,15 +298,11 @@ uint16_t Flash_If_Write(uint8_t *src, uint8_t *dest, uint32_t Len)
   */
 uint8_t *Flash_If_Read(uint8_t *src, uint8_t *dest, uint32_t Len)
 {
-  uint32_t i = 0;
-  uint8_t *psrc = src;
-  
-  for(i = 0; i < Len; i++)
-  {
-    dest[i] = *psrc++;
-  }
-  /* Return a valid address to avoid HardFault */
-  return (uint8_t*)(dest); 
+  UNUSED(dest);
+  UNUSED(Len);
+
+  /* Everything is memory mapped, EP0 sends straight from the source */
+  return src;
 }
 
 /**
@@ -200,6 +323,15 @@ uint16_t Flash_If_GetStatus(uint32_t Add, uint8_t Cmd, uint8_t *buffer)
     
   case DFU_MEDIA_ERASE:
   default:
+    if (((Add >= FLASH_APP_START) && (Add < FLASH_APP_END)) ||
+        ((erased & (1U << GetSector(Add))) != 0U))
+    {
+      /* Nothing to do, see Flash_If_Erase */
+      buffer[1] = 0;
+      buffer[2] = 0;
+      buffer[3] = 0;
+      break;
+    }
     buffer[1] = (uint8_t)FLASH_ERASE_TIME;
     buffer[2] = (uint8_t)(FLASH_ERASE_TIME << 8);
     buffer[3] = 0;  
@@ -208,6 +340,355 @@ uint16_t Flash_If_GetStatus(uint32_t Add, uint8_t Cmd, uint8_t *buffer)
   return 0; 
 }
 
+/**
+  * @brief  How long Flash_If_Write will take for a block, for the GETSTATUS
+  *         that starts it. A block that erases takes hundreds of ms, the
+  *         host should not poll into that.
+  * @param  src: The block, as it will be passed to Flash_If_Write.
+  * @param  dest: Where it goes.
+  * @param  Len: Its length in bytes.
+  * @retval bwPollTimeout in ms.
+  */
+uint32_t Flash_If_WriteTime(uint8_t *src, uint8_t *dest, uint32_t Len)
+{
+  const uint32_t words = (Len + 3U) / 4U;
+  const uint32_t end = (uint32_t)dest + words * 4U;
+  uint32_t base, ms = FLASH_PROGRAM_TIME;
+  uint8_t kind;
+
+  if (((uint32_t)dest < FLASH_APP_START) || ((uint32_t)dest >= FLASH_APP_END) || (end > IMAGE_TRAILER))
+  {
+    /* Programs or fails, nothing is erased there */
+    return ms;
+  }
+  kind = Block_Kind((const uint32_t *)src, (const uint32_t *)dest, words);
+  if (kind == BLOCK_SAME)
+  {
+    return ms;
+  }
+  if ((image_voided == 0U) && Image_Full())
+  {
+    /* Image_Void compacts the trailer sector first */
+    ms += FLASH_SECTOR_TIME;
+  }
+  if (kind == BLOCK_ERASE)
+  {
+    for (base = FLASH_APP_START + ((uint32_t)dest - FLASH_APP_START) / FLASH_APP_SECTOR * FLASH_APP_SECTOR;
+         base < end; base += FLASH_APP_SECTOR)
+    {
+      ms += FLASH_SECTOR_TIME;
+    }
+  }
+  return ms;
+}
+
+/**
+  * @brief  Checks the download before the device leaves DFU mode.
+  * @param  None
+  * @retval 0 if the flash matches what was received
+  */
+uint16_t Flash_If_Manifest(void)
+{
+  Image_trailer t;
+  Image_trailer *slot;
+  const Image_trailer *last;
+
+  if (Flash_Verify() != 0U)
+  {
+    return 2;
+  }
+  if (image_end == 0U)
+  {
+    /* Application untouched, its trailer still holds */
+    return 0;
+  }
+
+  t.magic = IMAGE_MAGIC;
+  t.length = image_end - IMAGE_START;
+  t.crc = image_crc(t.length);
+  t.check = ~t.crc;
+  image_start = image_end = 0;
+
+  last = image_last();
+  if ((image_voided == 0U) && (last != NULL) && (last->magic == t.magic) &&
+      (last->length == t.length) && (last->crc == t.crc) && (last->check == t.check))
+  {
+    /* Same image again, nothing changed */
+    return 0;
+  }
+
+  slot = image_next();
+  if (slot == NULL)
+  {
+    if (Sector_Erase(IMAGE_TRAILER & ~(FLASH_APP_SECTOR - 1U),
+                     IMAGE_TRAILER & ~(FLASH_APP_SECTOR - 1U), IMAGE_TRAILER) != 0U)
+    {
+      return 1;
+    }
+    slot = image_next();
+  }
+  if (Flash_Program((uint32_t *)slot, (const uint32_t *)&t, sizeof(t) / 4U, 0U) != 0U)
+  {
+    return 1;
+  }
+  image_voided = 0;
+  return 0;
+}
+
+/**
+  * @brief  Answers FLASH_VENDOR_* requests.
+  * @param  req: Setup request, device to host.
+  * @param  len: Set to the length of the answer.
+  * @retval Answer, NULL to stall.
+  */
+uint8_t *Flash_If_Vendor(USBD_SetupReqTypedef *req, uint16_t *len)
+{
+  static uint32_t crc;
+  const uint32_t start = ADDR_FLASH_SECTOR_0 + (uint32_t)req->wValue * 4U;
+
+  switch (req->bRequest)
+  {
+  case FLASH_VENDOR_CRC:
+    if ((start + (uint32_t)req->wIndex * 4U) > ADDR_FLASH_SECTOR_4)
+    {
+      return NULL;
+    }
+    crc = Flash_Crc((const uint32_t *)start, req->wIndex);
+    *len = sizeof(crc);
+    return (uint8_t *)&crc;
+
+  case FLASH_VENDOR_STATS:
+    *len = sizeof(flash_stats);
+    return (uint8_t *)&flash_stats;
+
+  default:
+    return NULL;
+  }
+}
+
+/**
+  * @brief  CRC of a region, without disturbing a download in progress.
+  * @param  start: First word.
+  * @param  words: Number of words.
+  * @retval CRC, same parameters as image_crc.
+  */
+static uint32_t Flash_Crc(const uint32_t *start, uint32_t words)
+{
+  uint32_t running, i, crc;
+
+  /* Flash_If_Init may not have run yet */
+  __HAL_RCC_CRC_CLK_ENABLE();
+  running = CRC->DR;
+  CRC->CR = CRC_CR_RESET;
+  for (i = 0; i < words; i++)
+  {
+    CRC->DR = start[i];
+  }
+  crc = CRC->DR;
+
+  /* Reset loads INIT, which is how the Flash_Verify state gets back */
+  CRC->INIT = running;
+  CRC->CR = CRC_CR_RESET;
+  CRC->INIT = 0xFFFFFFFFU;
+  return crc;
+}
+
+/**
+  * @brief  Marks the application invalid until the next manifest, so an
+  *         interrupted download lands in DFU instead of a partial image.
+  *         Compacts the trailer sector first if there is no room for both
+  *         the void and the new trailer.
+  * @param  None
+  * @retval 0 if operation is successful, 1 else.
+  */
+static uint16_t Image_Void(void)
+{
+  static const uint32_t zero[sizeof(Image_trailer) / 4U];
+  const uint32_t base = IMAGE_TRAILER & ~(FLASH_APP_SECTOR - 1U);
+  Image_trailer *slot;
+
+  if (image_voided != 0U)
+  {
+    return 0;
+  }
+
+  if (Image_Full())
+  {
+    /* Still the old image at this point, keep all of it */
+    if (Sector_Erase(base, base, IMAGE_TRAILER) != 0U)
+    {
+      return 1;
+    }
+    slot = (Image_trailer *)IMAGE_TRAILER;
+  }
+  else
+  {
+    slot = image_next();
+  }
+
+  if (Flash_Program((uint32_t *)slot, zero, sizeof(zero) / 4U, 0U) != 0U)
+  {
+    return 1;
+  }
+  image_voided = 1;
+  return 0;
+}
+
+/**
+  * @brief  No room in the trailer slots for both the void and the new trailer.
+  * @param  None
+  * @retval 1 if Image_Void has to compact the trailer sector.
+  */
+static uint8_t Image_Full(void)
+{
+  const Image_trailer *slot = image_next();
+
+  return (slot == NULL) || (slot + 1 >= (Image_trailer *)IMAGE_END);
+}
+
+/**
+  * @brief  Compares a block against flash.
+  * @param  src: The block.
+  * @param  dest: Where it goes.
+  * @param  words: Its length in words.
+  * @retval BLOCK_SAME, BLOCK_BLANK if it can go on top, BLOCK_ERASE else.
+  */
+static uint8_t Block_Kind(const uint32_t *src, const uint32_t *dest, uint32_t words)
+{
+  uint8_t kind = BLOCK_SAME;
+  uint32_t i;
+
+  for (i = 0; i < words; i++)
+  {
+    if (dest[i] != src[i])
+    {
+      if (dest[i] != 0xFFFFFFFFU)
+      {
+        return BLOCK_ERASE;
+      }
+      kind = BLOCK_BLANK;
+    }
+  }
+  return kind;
+}
+
+/**
+  * @brief  Erases an application sector and programs back part of it.
+  *         Voids the image again if the trailer slots were in it.
+  * @param  Base: First address of the sector.
+  * @param  KeepStart: First address to keep.
+  * @param  KeepEnd: Address after the last one to keep, may be below KeepStart.
+  * @retval 0 if operation is successful, 1 else.
+  */
+static uint16_t Sector_Erase(uint32_t Base, uint32_t KeepStart, uint32_t KeepEnd)
+{
+  const uint32_t words = (KeepEnd > KeepStart) ? (KeepEnd - KeepStart) / 4U : 0U;
+  uint32_t i, sectorerror = 0;
+  FLASH_EraseInitTypeDef eraseinitstruct;
+
+  for (i = 0; i < words; i++)
+  {
+    sector_copy[i] = ((const uint32_t *)KeepStart)[i];
+  }
+
+  eraseinitstruct.TypeErase = FLASH_TYPEERASE_SECTORS;
+  eraseinitstruct.Sector = GetSector(Base);
+  eraseinitstruct.NbSectors = 1;
+  eraseinitstruct.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+  if (HAL_FLASHEx_Erase(&eraseinitstruct, &sectorerror) != HAL_OK)
+  {
+    return 1;
+  }
+  flash_stats.erased++;
+
+  if (Flash_Program((uint32_t *)KeepStart, sector_copy, words, 0U) != 0U)
+  {
+    return 1;
+  }
+  if ((IMAGE_TRAILER >= Base) && (IMAGE_TRAILER < Base + FLASH_APP_SECTOR) && (image_voided != 0U))
+  {
+    image_voided = 0;
+    return Image_Void();
+  }
+  return 0;
+}
+
+/**
+  * @brief  Programs words without going through HAL_FLASH_Program, which
+  *         sets up and waits with a HAL_GetTick timeout for every single word.
+  *         Skips words that already hold the value. Data is fed into the
+  *         CRC unit while the flash is busy.
+  * @param  dest: Word aligned flash address.
+  * @param  src: Data.
+  * @param  words: Number of words.
+  * @param  crc: Feed the data into the CRC unit for Flash_Verify.
+  * @retval 0 if operation is successful, 1 on a flash error.
+  */
+static uint16_t Flash_Program(uint32_t *dest, const uint32_t *src, uint32_t words, uint8_t crc)
+{
+  uint32_t i;
+
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+  MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE, FLASH_PSIZE_WORD);
+  FLASH->CR |= FLASH_CR_PG;
+  for (i = 0; i < words; i++)
+  {
+    if (crc != 0U)
+    {
+      CRC->DR = src[i];
+    }
+    if (dest[i] == src[i])
+    {
+      /* Already there, erased words included */
+      flash_stats.words_skipped++;
+      continue;
+    }
+    dest[i] = src[i];
+    __DSB();
+    flash_stats.words_programmed++;
+    while ((FLASH->SR & FLASH_SR_BSY) != 0U);
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+
+  return ((FLASH->SR & FLASH_FLAG_ALL_ERRORS) != 0U) ? 1U : 0U;
+}
+
+/**
+  * @brief  Reads back the span programmed since the last check.
+  * @param  None
+  * @retval 0 if it matches, 2 else.
+  */
+static uint16_t Flash_Verify(void)
+{
+  const uint32_t expected = CRC->DR;
+  const uint32_t *p;
+  uint32_t got;
+
+  CRC->CR = CRC_CR_RESET;
+  for (p = (const uint32_t *)verify_start; p < (const uint32_t *)verify_end; p++)
+  {
+    CRC->DR = *p;
+  }
+  got = CRC->DR;
+  CRC->CR = CRC_CR_RESET;
+  verify_start = verify_end;
+
+  return (got == expected) ? 0U : 2U;
+}
+
+/**
+  * @brief  Gets the sectors touched by an address range
+  * @param  Start First address
+  * @param  End Address after the last one
+  * @retval Bit per FLASH_SECTOR_x
+  */
+static uint32_t GetSectorMask(uint32_t Start, uint32_t End)
+{
+  const uint32_t first = GetSector(Start), last = GetSector(End - 1U);
+
+  return ((1U << (last - first + 1U)) - 1U) << first;
+}
+
 /**
   * @brief  Gets the sector of a given address
   * @param  Address Address of the FLASH Memory
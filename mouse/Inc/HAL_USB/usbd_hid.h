@@ -67,6 +67,12 @@ extern "C" {
 
 #define HID_REQ_SET_REPORT                         0x09U
 #define HID_REQ_GET_REPORT                         0x01U
+
+#define HID_REPORT_TYPE_INPUT                      0x01U
+#define HID_REPORT_TYPE_OUTPUT                     0x02U
+#define HID_REPORT_TYPE_FEATURE                    0x03U
+
+#define HID_FEATURE_BUF_SIZE                       128U
 /**
   * @}
   */
@@ -122,6 +128,7 @@ uint8_t USBD_HID_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 uint8_t USBD_HID_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 uint8_t USBD_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+uint8_t USBD_HID_EP0_RxReady(USBD_HandleTypeDef *pdev);
 uint8_t *USBD_HID_GetFSCfgDesc(uint16_t *length);
 uint8_t *USBD_HID_GetHSCfgDesc(uint16_t *length);
 uint8_t *USBD_HID_GetOtherSpeedCfgDesc(uint16_t *length);
@@ -37,13 +37,22 @@ struct Anim {
 
 void anim_set_scale(int scale);
 
-void anim_add(int reps, int len_seq, const struct Anim seq[]);
+// queue reps repetitions of seq. only a reference to seq is queued, so it
+// must stay valid and in RAM (anim_read may not touch flash while it is
+// programmed) until played. returns 0 if the queue is full.
+int anim_add(int reps, int len_seq, const struct Anim seq[]);
 
 void anim_num(const uint16_t x);
 
 struct Xy anim_read(void);
 
-#define ANIM(l, _x, _y) ((struct Anim){.len = (l), .xy = (struct Xy){.x = (_x), .y = (_y)}})
+#define ANIM(l, _x, _y) {.len = (l), .xy = {.x = (_x), .y = (_y)}}
+
+// anim_add with a sequence in static storage, for use in the macros below
+#define anim_seq(reps, ...) ({ \
+	static struct Anim _seq[] = {__VA_ARGS__}; \
+	anim_add((reps), sizeof(_seq)/sizeof(_seq[0]), _seq); \
+})
 
 #define LEN_LONG 500
 #define LEN_MEDIUM 125
@@ -68,25 +77,25 @@ struct Xy anim_read(void);
 #define LEFT_SLOW  ANIM(LEN_MEDIUM / SPEED_SLOW, -SPEED_SLOW,  0)
 #define RIGHT_SLOW ANIM(LEN_MEDIUM / SPEED_SLOW,  SPEED_SLOW,  0)
 
-#define anim_cw(reps) anim_add((reps), 4, (struct Anim[]){UP_SLOW, RIGHT_SLOW, DOWN_SLOW, LEFT_SLOW})
-#define anim_ccw(reps) anim_add((reps), 4, (struct Anim[]){RIGHT_SLOW, UP_SLOW, LEFT_SLOW, DOWN_SLOW})
-#define anim_one(reps) anim_add((reps), 2, (struct Anim[]){DOWN_SLOW, DOWN_SLOW})
-#define anim_eight(reps) anim_add((reps), 8, (struct Anim[]){DOWN_SLOW, RIGHT_SLOW, DOWN_SLOW, LEFT_SLOW, UP_SLOW, RIGHT_SLOW, UP_SLOW, LEFT_SLOW})
+#define anim_cw(reps) anim_seq((reps), UP_SLOW, RIGHT_SLOW, DOWN_SLOW, LEFT_SLOW)
+#define anim_ccw(reps) anim_seq((reps), RIGHT_SLOW, UP_SLOW, LEFT_SLOW, DOWN_SLOW)
+#define anim_one(reps) anim_seq((reps), DOWN_SLOW, DOWN_SLOW)
+#define anim_eight(reps) anim_seq((reps), DOWN_SLOW, RIGHT_SLOW, DOWN_SLOW, LEFT_SLOW, UP_SLOW, RIGHT_SLOW, UP_SLOW, LEFT_SLOW)
 
-#define anim_lg_updown(reps) anim_add((reps), 2, (struct Anim[]){UP_L, DOWN_L})
-#define anim_lg_downup(reps) anim_add((reps), 2, (struct Anim[]){DOWN_L, UP_L})
+#define anim_lg_updown(reps) anim_seq((reps), UP_L, DOWN_L)
+#define anim_lg_downup(reps) anim_seq((reps), DOWN_L, UP_L)
 
-#define anim_updown(reps) anim_add((reps), 2, (struct Anim[]){UP, DOWN})
-#define anim_downup(reps) anim_add((reps), 2, (struct Anim[]){DOWN, UP})
+#define anim_updown(reps) anim_seq((reps), UP, DOWN)
+#define anim_downup(reps) anim_seq((reps), DOWN, UP)
 
-#define anim_leftright(reps) anim_add((reps), 2, (struct Anim[]){LEFT, RIGHT})
-#define anim_rightleft(reps) anim_add((reps), 2, (struct Anim[]){RIGHT, LEFT})
+#define anim_leftright(reps) anim_seq((reps), LEFT, RIGHT)
+#define anim_rightleft(reps) anim_seq((reps), RIGHT, LEFT)
 
-#define anim_updown_pause(reps) anim_add((reps), 3, (struct Anim[]){UP, DOWN, PAUSE})
-#define anim_downup_pause(reps) anim_add((reps), 3, (struct Anim[]){DOWN, UP, PAUSE})
-#define anim_leftright_pause(reps) anim_add((reps), 3, (struct Anim[]){LEFT, RIGHT, PAUSE})
-#define anim_rightleft_pause(reps) anim_add((reps), 3, (struct Anim[]){RIGHT, LEFT, PAUSE})
+#define anim_updown_pause(reps) anim_seq((reps), UP, DOWN, PAUSE)
+#define anim_downup_pause(reps) anim_seq((reps), DOWN, UP, PAUSE)
+#define anim_leftright_pause(reps) anim_seq((reps), LEFT, RIGHT, PAUSE)
+#define anim_rightleft_pause(reps) anim_seq((reps), RIGHT, LEFT, PAUSE)
 
-#define anim_diag(reps) anim_add((reps), 1, (struct Anim[]){ANIM(300, SPEED_SLOW, SPEED_SLOW)})
+#define anim_diag(reps) anim_seq((reps), ANIM(300, SPEED_SLOW, SPEED_SLOW))
 
-#define anim_pause(ms) anim_add(1, 1, (struct Anim[]){ANIM(ms, 0, 0)});
+#define anim_pause(ms) anim_seq((ms), ANIM(1, 0, 0))
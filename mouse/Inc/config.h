@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include "cmsis_compiler.h"
+#include "motion.h"
 // flags bits
 //		|15		|14		|13		|12		|11		|10		|9		|8 ... 0|
 // 0	|		|AS off	|FS USB	|	Interval	|      LOD      |DPI	|
@@ -57,5 +58,49 @@ typedef uint16_t Config;
 
 extern const Config config_default;
 
+// profiles: sensor and motion settings the host can store and switch between.
+// kept in RAM, persisted to the config sector journal by
+// config_step() from the main loop, so a store never blocks a report.
+#define PROFILE_NUM 8
+#define PROFILE_NONE 0xFF // no profile selected, the sensor runs from Config
+
+typedef struct {
+	uint16_t dpi_x, dpi_y; // same encoding as CONFIG_DPI, per axis
+	uint8_t lod; // as CONFIG_LOD
+	uint8_t angle_snap;
+	uint8_t scale_on;
+	uint8_t curve_on;
+	int16_t scale_m[2][2]; // Q2.14, see Motion_scale
+	uint8_t curve_shift; // see Motion_curve
+	uint8_t _pad;
+	uint16_t curve_gain[CURVE_LEN];
+} Profile;
+static_assert(sizeof(Profile) % sizeof(uint32_t) == 0, "Profile not word sized");
+
 Config config_read(void);
 void config_write(Config cfg);
+
+// valid after config_read()
+const Profile *config_profile(int slot); // NULL if the slot was never stored
+uint8_t config_profile_selected(void); // PROFILE_NONE if none
+
+// these only queue the flash write, and are safe to call from PendSV
+void config_profile_store(int slot, const Profile *p);
+void config_profile_select(uint8_t slot);
+
+// advance the queued flash writes by at most one word or erase.
+// call with PendSV masked. returns 1 while the flash is busy.
+// an erase keeps the flash busy for hundreds of ms, in which the control
+// bottom half can't run. it only starts with may_erase, i.e. when no
+// control request is in flight, so a new one waits at most that long.
+int config_step(int may_erase);
+
+// finish the queued writes, for use before the main loop
+static inline void config_flush(void)
+{
+	while (config_step(1))
+		;
+}
+
+// flash ops that failed since boot, see Usb_stats.flash_errors
+uint32_t config_errors(void);
@@ -0,0 +1,52 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "stm32f7xx.h"
+
+// DWT cycle counter, counts HCLK cycles and wraps every ~134s at 32MHz.
+// take differences with unsigned subtraction.
+#define CYCLES_PER_US 32 // HCLK, see clk_init
+static inline void cycles_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55; // the M7 DWT is locked after reset
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t cycles_now(void)
+{
+	return DWT->CYCCNT;
+}
+
+// busy wait until cond is true or timeout_us has passed. evaluates to cond.
+#define cycles_poll(cond, timeout_us) ({ \
+	const uint32_t _start = cycles_now(); \
+	int _ok; \
+	while (!(_ok = (cond)) && cycles_now() - _start < (timeout_us) * CYCLES_PER_US) \
+		; \
+	_ok; \
+})
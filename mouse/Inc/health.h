@@ -0,0 +1,122 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+// the sensor is checked in the idle time after a report, and re-initialised
+// step by step between reports if it stops answering, e.g. after a brown-out.
+// usb stays enumerated and reports go on with zero motion meanwhile. the
+// checks read the ids, a drop-out shorter than HEALTH_FAILS of them that
+// resets the sensor goes unnoticed.
+//
+// paw3399.h and cycles.h in angle brackets: tools/test_health puts a sensor
+// double and a simulated clock ahead of them.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cycles.h>
+#include <paw3399.h>
+#include "config.h"
+#include "usb.h"
+
+#define HEALTH_EVERY 1024 // loops between checks, 1/8s at 8kHz
+#define HEALTH_FAILS 3 // failed checks in a row before a re-init
+
+typedef struct {
+	uint8_t id[2]; // PAW3399_PRODUCT_ID and PAW3399_INV_PRODUCT_ID after init
+	uint8_t step; // which of them the next check reads
+	uint8_t fails;
+	int count; // loops to the next check
+	int down; // re-init running
+	Paw3399_init init;
+	uint32_t next_at; // cycles_now() of the next init step
+	uint32_t down_at;
+} Sensor_health;
+
+static const uint8_t health_reg[2] = {PAW3399_PRODUCT_ID, PAW3399_INV_PRODUCT_ID};
+
+// after paw3399_init, what the checks compare against
+static void health_init(Sensor_health *h)
+{
+	h->id[0] = paw3399_read(PAW3399_PRODUCT_ID);
+	h->id[1] = paw3399_read(PAW3399_INV_PRODUCT_ID);
+	h->count = HEALTH_EVERY;
+}
+
+// one register read, about 6us
+static void health_check(Sensor_health *h)
+{
+	h->count = HEALTH_EVERY;
+	const uint8_t v = paw3399_read(health_reg[h->step]);
+	if (v == h->id[h->step]) {
+		h->step ^= 1;
+		h->fails = 0;
+		return;
+	}
+	usb_stats.sensor_fails++;
+	if (++h->fails < HEALTH_FAILS)
+		return;
+	h->fails = 0;
+	h->down = 1;
+	h->down_at = cycles_now();
+	h->next_at = h->down_at;
+	h->init = (Paw3399_init){0};
+}
+
+// the longer steps write for a few hundred us, the loop misses a few SOFs.
+// img is the profile to apply after the init, NULL for none.
+static void health_reinit(Sensor_health *h, const Config cfg, const Paw3399_image *img)
+{
+	if ((int32_t)(cycles_now() - h->next_at) < 0)
+		return;
+	const uint32_t us = paw3399_init_step(&h->init, cfg);
+	if (us != 0) {
+		h->next_at = cycles_now() + us * CYCLES_PER_US;
+		return;
+	}
+	if (h->init.timeouts != 0) {
+		// it didn't answer in time, e.g. still without power. the checks
+		// would pass once it is back, unconfigured, so start over.
+		h->init = (Paw3399_init){0};
+		return;
+	}
+	if (img != NULL)
+		paw3399_apply(img);
+	h->down = 0;
+	h->count = HEALTH_EVERY;
+	usb_stats.sensor_resets++;
+	usb_stats.sensor_recover_cycles = cycles_now() - h->down_at;
+}
+
+// once per loop, after the commit. health_check, health_reinit and
+// paw3399_init_step run from flash, so they wait while the flash is busy.
+static inline void health_loop(Sensor_health *h, const Config cfg, const Paw3399_image *img,
+		const int flash_idle)
+{
+	if (h->down) {
+		if (flash_idle)
+			health_reinit(h, cfg, img);
+	} else if (--h->count <= 0 && flash_idle) {
+		health_check(h);
+	}
+}
@@ -0,0 +1,87 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+// programming modes, entered by holding LMB+RMB while lifted:
+// TIMEOUT_SECS shows the dpi, release then for dpi programming,
+// 2*TIMEOUT_SECS shows LOD/Hz, release then for LOD/Hz programming.
+// holding LMB+RMB lifted again for TIMEOUT_SECS saves and leaves.
+//
+// a state/transition table driven by input changes and one tick deadline.
+// mode_changed() is the whole per-microframe cost while nothing happens,
+// mode_event() runs the table only when it returns 1. skipping both for a
+// while only delays the events, edges in between are merged.
+#define TIMEOUT_SECS 5 // seconds of holding buttons for programming mode
+
+typedef enum {
+	MODE_NORMAL,
+	MODE_HOLD1, // LMB+RMB lifted, counting to the first timeout
+	MODE_ARMED1_HOLD, // past it, counting to the second
+	MODE_ARMED1, // past it, combo interrupted, count paused
+	MODE_ARMED2, // past the second timeout, waiting for release
+	MODE_DPI,
+	MODE_DPI_HOLD, // counting to save and leave
+	MODE_LODHZ,
+	MODE_LODHZ_HOLD,
+	MODE_STATE_NUM
+} Mode_state;
+
+// what mode_event changed in Config, for the caller to apply
+#define MODE_FX_DPI  (1 << 0) // paw3399_set_dpi
+#define MODE_FX_LOD  (1 << 1) // paw3399_set_lod
+#define MODE_FX_ITV  (1 << 2) // report interval
+#define MODE_FX_SAVE (1 << 3) // config_write
+
+#define MODE_IN_LIFTED (1 << 7) // or'd into the buttons
+#define MODE_NEVER     0 // deadline when none is armed
+
+typedef struct {
+	uint8_t state; // Mode_state
+	uint8_t in; // buttons | MODE_IN_LIFTED, as of the last event
+	uint8_t in_prev;
+	uint8_t large_step; // ignore releases of the other button for large dpi steps
+	int hs;
+	uint32_t now; // microframes, wraps after days, see mode_event
+	uint32_t deadline;
+	uint32_t left; // of a paused count
+	uint32_t timeout_ticks;
+	uint32_t mask; // input mask for the report
+} Mode;
+
+void mode_init(Mode *m, int hs);
+
+static inline int mode_changed(Mode *m, const uint8_t btn, const int lifted)
+{
+	const uint8_t in = btn | (lifted ? MODE_IN_LIFTED : 0);
+	m->now++;
+	m->in_prev = m->in;
+	m->in = in;
+	return (in != m->in_prev) | (m->now == m->deadline);
+}
+
+// returns MODE_FX_* for the changes made to cfg. runs from flash.
+uint32_t mode_event(Mode *m, Config *cfg);
@@ -0,0 +1,207 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// motion not yet reported to the host.
+// sensor deltas and report fields are 16 bit, but while the host is not
+// collecting reports (fifo flushes, interval skips) their sum can exceed that.
+// the backlog is kept wide and handed out in report sized pieces, so nothing
+// is wrapped or dropped. at the sensor's maximum of ~2k counts per microframe,
+// int32 lasts for minutes without a single report collected.
+typedef struct {
+	int32_t x, y;
+	int32_t whl;
+} Motion_acc;
+
+static inline void acc_add(Motion_acc *acc, const int32_t x, const int32_t y, const int32_t whl)
+{
+	acc->x += x;
+	acc->y += y;
+	acc->whl += whl;
+}
+
+// take as much of v as fits in the report descriptor's logical range [-lim, lim]
+// and leave the remainder for following reports
+static inline int32_t acc_take(int32_t *v, const int32_t lim)
+{
+	const int32_t out = (*v > lim) ? lim : (*v < -lim) ? -lim : *v;
+	*v -= out;
+	return out;
+}
+
+#define acc_take_xy(v) ((int16_t)acc_take((v), 32767))
+#define acc_take_whl(v) ((int8_t)acc_take((v), 127))
+
+// two int16 in one word, as the DSP instructions want them
+#define PACK16(lo, hi) (((uint32_t)(uint16_t)(hi) << 16) | (uint16_t)(lo))
+
+// dual 16x16 multiply accumulate, acc + lo(a)*lo(b) + hi(a)*hi(b)
+#if defined(__ARM_FEATURE_DSP)
+#include "cmsis_compiler.h"
+#define smlad(a, b, acc) ((int32_t)__SMLAD((a), (b), (uint32_t)(acc)))
+#else
+static inline int32_t smlad(const uint32_t a, const uint32_t b, const int32_t acc)
+{
+	return acc + (int16_t)a * (int16_t)b + (int16_t)(a >> 16) * (int16_t)(b >> 16);
+}
+#endif
+
+// 2x2 fixed point matrix applied to the sensor deltas, for cpi between the
+// sensor's 50 cpi steps and for rotated grips.
+// coefficients are Q2.14 in [-2, 2): 1.0 is exact, and there is headroom to
+// scale up as well as down. still 16 bit, so one SMLAD computes each output
+// axis.
+// the fraction below one count is carried into the next microframe, so the
+// sum of the output never drifts from the exact product of the summed input.
+#define SCALE_Q 14
+#define SCALE_ONE (1 << SCALE_Q)
+
+typedef struct {
+	uint32_t on; // 0: sensor counts pass through unchanged
+	uint32_t row_x, row_y; // coefficients of each output axis, PACK16(from x, from y)
+	int32_t rem_x, rem_y; // fraction carried over, Q14 in [0, 1)
+} Motion_scale;
+
+static inline void scale_init(Motion_scale *s, const int on,
+		const int16_t xx, const int16_t xy, const int16_t yx, const int16_t yy)
+{
+	s->on = on;
+	s->row_x = PACK16(xx, xy);
+	s->row_y = PACK16(yx, yy);
+	s->rem_x = s->rem_y = 1 << (SCALE_Q - 1); // start at one half to round to nearest
+}
+
+// xy = PACK16(x, y) straight from the sensor. a microframe's deltas are far
+// below the +-32k where the two products could overflow the 32 bit sum.
+static inline void scale_apply(Motion_scale *s, const uint32_t xy, int32_t *x, int32_t *y)
+{
+	const int32_t tx = smlad(xy, s->row_x, s->rem_x);
+	const int32_t ty = smlad(xy, s->row_y, s->rem_y);
+	*x = tx >> SCALE_Q; // arithmetic shift, rounds towards -inf
+	*y = ty >> SCALE_Q;
+	s->rem_x = tx & ((1 << SCALE_Q) - 1);
+	s->rem_y = ty & ((1 << SCALE_Q) - 1);
+}
+
+// response curve, replaces host side acceleration.
+// gain is a table over speed in counts per ms, linearly interpolated between
+// entries that are 1 << shift apart and held after the last one. the loop
+// runs 8 times a ms at high speed and once at full speed, so the same curve
+// feels the same at either.
+// no loops, so the cost per microframe is fixed. all of RAM is DTCM, so the
+// table reads have no wait states.
+#define CURVE_LEN 33
+#define CURVE_Q 12 // gain 1.0 = 4096, max almost 16
+#define CURVE_SHIFT_MAX 12
+
+// loops per ms as a shift
+#define CURVE_PER_MS_HS 3
+#define CURVE_PER_MS_FS 0
+
+typedef struct {
+	uint32_t on;
+	uint32_t shift;
+	int32_t rem_x, rem_y; // fraction carried over, Q12 in [0, 1)
+	uint16_t gain[CURVE_LEN]; // Q12 gain at speed i << shift
+} Motion_curve;
+
+// per_ms: CURVE_PER_MS_HS or _FS
+static inline int32_t curve_gain(const Motion_curve *c, const int per_ms,
+		const int32_t x, const int32_t y)
+{
+	// max + min/2 is within 12% of the euclidean length
+	const int32_t ax = (x < 0) ? -x : x;
+	const int32_t ay = (y < 0) ? -y : y;
+	const uint32_t s = ((ax > ay) ? ax + (ay >> 1) : ay + (ax >> 1)) << per_ms;
+	const uint32_t i = s >> c->shift;
+	if (i >= CURVE_LEN - 1)
+		return c->gain[CURVE_LEN - 1];
+	const int32_t f = s & ((1 << c->shift) - 1);
+	return c->gain[i] + (((c->gain[i + 1] - c->gain[i]) * f) >> c->shift);
+}
+
+static inline void curve_init(Motion_curve *c, const int on, const int shift,
+		const uint16_t gain[CURVE_LEN])
+{
+	c->on = on;
+	c->shift = shift;
+	c->rem_x = c->rem_y = 1 << (CURVE_Q - 1);
+	for (int i = 0; i < CURVE_LEN; i++)
+		c->gain[i] = gain[i];
+}
+
+// |x|, |y| below 2^15 per loop (the sensor tops out around 13k counts per ms)
+// keep the products within 32 bits
+static inline void curve_apply(Motion_curve *c, const int per_ms, int32_t *x, int32_t *y)
+{
+	const int32_t g = curve_gain(c, per_ms, *x, *y);
+	const int32_t tx = *x * g + c->rem_x;
+	const int32_t ty = *y * g + c->rem_y;
+	*x = tx >> CURVE_Q;
+	*y = ty >> CURVE_Q;
+	c->rem_x = tx & ((1 << CURVE_Q) - 1);
+	c->rem_y = ty & ((1 << CURVE_Q) - 1);
+}
+
+// lift detection on the SQUAL byte of the motion burst. a lifted 3399
+// typically reads squal in the 60s. hysteresis keeps noise around one
+// threshold from toggling it, and a change needs debounce reads in a row.
+// while lifted, the sensor's deltas are only noise from the edge of LOD.
+#define LIFT_SQUAL_BELOW 75 // lifted under this
+#define LIFT_SQUAL_FROM 85 // landed again at or above this
+
+typedef struct {
+	uint8_t on; // 0: lifted is still tracked, but motion is not gated
+	uint8_t below, from;
+	uint8_t debounce; // reads to change state, at least 1
+	uint8_t n; // reads in a row towards the other state
+	uint8_t lifted;
+} Motion_lift;
+
+static inline void lift_init(Motion_lift *l, const int on,
+		const uint8_t below, const uint8_t from, const uint8_t debounce)
+{
+	l->on = on;
+	l->below = below;
+	l->from = from;
+	l->debounce = debounce;
+	l->n = 0;
+}
+
+// returns 1 on a change of l->lifted
+static inline int lift_update(Motion_lift *l, const uint8_t squal)
+{
+	const int towards = l->lifted ? (squal >= l->from) : (squal < l->below);
+	if (!towards) {
+		l->n = 0;
+		return 0;
+	}
+	if (++l->n < l->debounce)
+		return 0;
+	l->n = 0;
+	l->lifted ^= 1;
+	return 1;
+}
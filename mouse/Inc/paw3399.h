@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include "stm32f7xx.h"
 #include "config.h"
+#include "itcm.h"
 
 static void spi_init(void)
 {
@@ -281,94 +282,205 @@ static void paw3399_set_lod(const uint8_t lod)
 	ss_high();
 }
 
-static void paw3399_init(const Config cfg)
+// the register writes behind a profile's sensor settings, computed when the
+// profile is stored, so switching to it needs neither paw3399_init nor any
+// decisions in the main loop
+#define PAW3399_IMAGE_LEN 9
+
+typedef struct {
+	struct {
+		uint8_t addr, data;
+	} w[PAW3399_IMAGE_LEN];
+} Paw3399_image;
+
+static void paw3399_image(Paw3399_image *img, const uint16_t dpi_x, const uint16_t dpi_y,
+		const uint8_t angle_snap, const uint8_t lod)
 {
-	const uint16_t dpi = _FLD2VAL(CONFIG_DPI, cfg);
-	const uint8_t ang_snap = (cfg & CONFIG_ANGLE_SNAP_ON) ? 1 : 0;
-	const uint8_t lod = _FLD2VAL(CONFIG_LOD, cfg);
+	const Paw3399_image i = {{
+		{0x48, dpi_x & 0xff}, // RESOLUTION_X_LOW
+		{0x49, dpi_x >> 8}, // RESOLUTION_X_HIGH
+		{0x4A, dpi_y & 0xff}, // RESOLUTION_Y_LOW
+		{0x4B, dpi_y >> 8}, // RESOLUTION_Y_HIGH
+		{0x47, 0x01}, // SET_RESOLUTION
+		{0x56, (angle_snap << 7) | 0x0D},
+		{0x7F, 0x0C},
+		{0x4E, 0x08 | lod},
+		{0x7F, 0x00},
+	}};
+	*img = i;
+}
 
-	NRESET_GPIO_CLK_ENABLE();
-	__NOP();__NOP();__NOP();__NOP(); // probably unnecessary
-	MODIFY_REG(NRESET_PORT->MODER,
-			0b11 << (2*NRESET_PIN_Pos),
-			0b01 << (2*NRESET_PIN_Pos));
-	delay_ms(10);
-	NRESET_PORT->ODR |= NRESET_PIN; // drive NRESET high
-	delay_ms(10);
+// about 60us of writes. in ITCM, it may run while config_step has the flash busy
+__ITCM static void paw3399_apply(const Paw3399_image *img)
+{
 	ss_low();
-	delay_ms(1);
-	NRESET_PORT->ODR &= ~NRESET_PIN; // drive NRESET low
-	delay_ms(1);
-	NRESET_PORT->ODR |= NRESET_PIN; // drive NRESET high
-	delay_ms(1);
-	spi_write(0x3A, 0x5A); // 6.1.4
+	for (int i = 0; i < PAW3399_IMAGE_LEN; i++) {
+		spi_send(img->w[i].addr | 0x80);
+		spi_send(img->w[i].data);
+		delay_us(5); // maximum of t_SWW, t_SWR
+	}
 	ss_high();
-	delay_ms(10); // 6.1.5
+}
+
+// paw3399_init in steps, so the main loop can re-init the sensor between
+// reports. each step returns the microseconds to wait before the next,
+// 0 when done.
+typedef struct {
+	uint8_t stage;
+	uint8_t polls; // of the product id after reset, of 0x6C in 6.2.100-107
+	uint8_t timeouts; // polls that gave up
+} Paw3399_init;
 
-	// 6.1.6
-	paw3399_spi1();
-	// 6.2.100-107
+#define PAW3399_POLL_US 100
+#define PAW3399_RESET_US 10000 // minimum after NRESET and after the 0x3A reset (6.1.5)
+
+// the sensor answers on spi, i.e. is out of reset. MISO reads all 0s or 1s before.
+static int paw3399_answers(void)
+{
 	ss_low();
-	spi_write(0x22, 0x01);
+	const uint8_t id = spi_read(0x00); // PAW3399_PRODUCT_ID
 	ss_high();
-	int i;
-	for (i = 0; i < 60; i++) {
+	return id != 0x00 && id != 0xFF;
+}
+
+// stays at the current stage until the sensor answers, for at most
+// polls_max * PAW3399_POLL_US. only after PAW3399_RESET_US: it may answer
+// on spi before its reset is done.
+#define PAW3399_WAIT_ANSWER(st, polls_max) \
+	if (!paw3399_answers()) { \
+		if (++(st)->polls < (polls_max)) { \
+			(st)->stage--; \
+			return PAW3399_POLL_US; \
+		} \
+		(st)->timeouts++; \
+	} \
+	(st)->polls = 0;
+
+static uint32_t paw3399_init_step(Paw3399_init *st, const Config cfg)
+{
+	const uint16_t dpi = _FLD2VAL(CONFIG_DPI, cfg);
+	const uint8_t ang_snap = (cfg & CONFIG_ANGLE_SNAP_ON) ? 1 : 0;
+	const uint8_t lod = _FLD2VAL(CONFIG_LOD, cfg);
+
+	switch (st->stage++) {
+	case 0:
+		NRESET_GPIO_CLK_ENABLE();
+		__NOP();__NOP();__NOP();__NOP(); // probably unnecessary
+		MODIFY_REG(NRESET_PORT->MODER,
+				0b11 << (2*NRESET_PIN_Pos),
+				0b01 << (2*NRESET_PIN_Pos));
+		return 10000;
+	case 1:
+		NRESET_PORT->ODR |= NRESET_PIN; // drive NRESET high
+		st->polls = 0;
+		return PAW3399_RESET_US;
+	case 2:
+		PAW3399_WAIT_ANSWER(st, 100);
+		ss_low();
+		return 1000;
+	case 3:
+		NRESET_PORT->ODR &= ~NRESET_PIN; // drive NRESET low
+		return 1000;
+	case 4:
+		NRESET_PORT->ODR |= NRESET_PIN; // drive NRESET high
+		return 1000;
+	case 5:
+		spi_write(0x3A, 0x5A); // 6.1.4
 		ss_high();
-		delay_us(992); // ideally, tune this and/or use dedicated timer or systick
+		return PAW3399_RESET_US; // 6.1.5
+	case 6:
+		PAW3399_WAIT_ANSWER(st, 100);
+		// 6.1.6
+		paw3399_spi1();
+		// 6.2.100-107
 		ss_low();
-		if (spi_read(0x6C) == 0x80) break;
-	}
-	ss_low();
-	if (i == 60) {
-		spi_write(0x7C, 0x14);
-		spi_write(0x6C, 0x00);
+		spi_write(0x22, 0x01);
+		ss_high();
+		st->polls = 0;
+		return 992; // ideally, tune this and/or use dedicated timer or systick
+	case 7:
+		ss_low();
+		if (spi_read(0x6C) != 0x80 && ++st->polls < 60) {
+			ss_high();
+			st->stage--; // poll again
+			return 992;
+		}
+		if (st->polls == 60) {
+			st->timeouts++;
+			spi_write(0x7C, 0x14);
+			spi_write(0x6C, 0x00);
+			spi_write(0x7F, 0x00);
+		}
+		spi_write(0x22, 0x00);
+		spi_write(0x55, 0x00);
 		spi_write(0x7F, 0x00);
-	}
-	spi_write(0x22, 0x00);
-	spi_write(0x55, 0x00);
-	spi_write(0x7F, 0x00);
-	spi_write(0x40, 0x00);
-	ss_high();
+		spi_write(0x40, 0x00);
+		ss_high();
 
-	// equivalent of 7.3
-	paw3399_spi2();
+		// equivalent of 7.3
+		paw3399_spi2();
 
-	// new placement for anti-jitter configuration
-	ss_low();
-	spi_write(0x7f, 0x05);
-	spi_write(0x43, 0x64);
-	spi_write(0x7f, 0x00);
-	ss_high();
+		// new placement for anti-jitter configuration
+		ss_low();
+		spi_write(0x7f, 0x05);
+		spi_write(0x43, 0x64);
+		spi_write(0x7f, 0x00);
+		ss_high();
 
-	// 6.1.7
-	ss_low();
-	(void)spi_read(0x02);
-	(void)spi_read(0x03);
-	(void)spi_read(0x04);
-	(void)spi_read(0x05);
-	(void)spi_read(0x06);
-	ss_high();
+		// 6.1.7
+		ss_low();
+		(void)spi_read(0x02);
+		(void)spi_read(0x03);
+		(void)spi_read(0x04);
+		(void)spi_read(0x05);
+		(void)spi_read(0x06);
+		ss_high();
 
-	// ???
-	ss_low();
-	spi_write(0x68, 0x01);
-	ss_high();
+		// ???
+		ss_low();
+		spi_write(0x68, 0x01);
+		ss_high();
 
-	paw3399_set_dpi(dpi);
-	paw3399_set_as(ang_snap);
-	paw3399_set_lod(lod);
+		paw3399_set_dpi(dpi);
+		paw3399_set_as(ang_snap);
+		paw3399_set_lod(lod);
 
-	// invert x
-	ss_low();
-	spi_write(0x5B, 0x20);
-	ss_high();
+		// invert x
+		ss_low();
+		spi_write(0x5B, 0x20);
+		ss_high();
 
-	// ???
-	delay_us(3000); // in ***, there is a 383ms delay
+		// ??? no register to poll for whatever this waits for
+		return 3000; // in ***, there is a 383ms delay
+	default:
+		ss_low();
+		spi_write(0x7F, 0x0D);
+		spi_write(0x48, 0xDC);
+		spi_write(0x7F, 0x00);
+		ss_high();
+		return 0;
+	}
+}
+
+// returns 0 if a poll timed out
+static int paw3399_init(const Config cfg)
+{
+	Paw3399_init st = {0};
+	uint32_t us;
+	while ((us = paw3399_init_step(&st, cfg)) != 0)
+		delay_us(us);
+	return st.timeouts == 0;
+}
+
+// registers the health check compares against their values after init
+#define PAW3399_PRODUCT_ID     0x00
+#define PAW3399_INV_PRODUCT_ID 0x3F
+
+static uint8_t paw3399_read(const uint8_t addr)
+{
 	ss_low();
-	spi_write(0x7F, 0x0D);
-	spi_write(0x48, 0xDC);
-	spi_write(0x7F, 0x00);
+	const uint8_t v = spi_read(addr);
 	ss_high();
+	return v;
 }
 
@@ -0,0 +1,169 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+// the report format and the part of the main loop that fills it, from raw
+// button, wheel and motion input to the packet that goes into the fifo.
+// nothing in here touches a peripheral, so tools/uhid_bridge.c runs the same
+// code on a pc.
+
+#include <assert.h>
+#include <stdint.h>
+#include "motion.h"
+
+#ifndef __PACKED
+#define __PACKED __attribute__((packed))
+#endif
+
+// HID_MOUSE_ReportDesc in usbd_hid.c, HID_MOUSE_REPORT_DESC_SIZE bytes
+#define HID_MOUSE_REPORT_DESC { \
+	0x05, 0x01,             /* Usage Page (Generic Desktop) */ \
+	0x09, 0x02,             /* Usage (Mouse) */ \
+	0xA1, 0x01,             /* Collection (Application) */ \
+	0x05, 0x09,             /*   Usage Page (Button) */ \
+	0x19, 0x01,             /*   Usage Minimum (Button #1) */ \
+	0x29, 0x03,             /*   Usage Maximum (Button #3) */ \
+	0x15, 0x00,             /*   Logical Minimum (0) */ \
+	0x25, 0x01,             /*   Logical Maximum (1) */ \
+	0x95, 0x03,             /*   Report Count (3) */ \
+	0x75, 0x01,             /*   Report Size (1) */ \
+	0x81, 0x02,             /*   Input (Data, Variable, Absolute) */ \
+	0x95, 0x01,             /*   Report Count (1) */ \
+	0x75, 0x05,             /*   Report Size (5) */ \
+	0x81, 0x03,             /*   Input (Constant) // Byte 1 */ \
+	\
+	0x05, 0x01,             /*   Usage Page (Generic Desktop) */ \
+	\
+	0x09, 0x38,             /*   Usage (Wheel) */ \
+	0x15, 0x81,             /*   Logical Minimum (-127) */ \
+	0x25, 0x7F,             /*   Logical Maximum (127) */ \
+	0x35, 0x81,             /*   Physical Minimum (-127) */ \
+	0x45, 0x7F,             /*   Physical Maximum (127) */ \
+	0x75, 0x08,             /*   Report Size (8) */ \
+	0x95, 0x01,             /*   Report Count (1) */ \
+	0x81, 0x06,             /*   Input (Data, Variable, Relative) // Byte 2 */ \
+	\
+	0x09, 0x30,             /*   Usage (X) */ \
+	0x09, 0x31,             /*   Usage (Y) */ \
+	0x16, 0x01, 0x80,       /*   Logical Minimum (-32,767) */ \
+	0x26, 0xFF, 0x7F,       /*   Logical Maximum (32,767) */ \
+	0x36, 0x01, 0x80,       /*   Physical Minimum (-32,767) */ \
+	0x46, 0xFF, 0x7F,       /*   Physical Maximum (32,767) */ \
+	0x75, 0x10,             /*   Report Size (16), */ \
+	0x95, 0x02,             /*   Report Count (2), */ \
+	0x81, 0x06,             /*   Input (Data, Variable, Relative) // Byte 3-6 */ \
+	\
+	0xC0                    /* End Collection */ \
+}
+
+typedef union {
+	struct __PACKED { // use the order in the report descriptor
+		uint8_t btn;
+		int8_t whl;
+		int16_t x, y;
+		uint16_t _pad; // zero pad to 8 bytes total
+	};
+	uint8_t u8[8]; // btn, wheel, xlo, xhi, ylo, yhi, 0, 0
+	uint32_t u32[2];
+} Usb_packet;
+static_assert(sizeof(Usb_packet) == 2*sizeof(uint32_t), "Usb_packet wrong size");
+
+// buttons from btn_read(), (NC << 8) | NO, both active low. a button that
+// is between its contacts (bouncing) keeps its previous state.
+static inline uint8_t btn_latch(const uint16_t btn_raw, const uint8_t btn_prev)
+{
+	const uint8_t btn_NO = (btn_raw & 0xFF);
+	const uint8_t btn_NC = (btn_raw >> 8);
+	return (~btn_NO & 0b111) | (btn_NC & btn_prev);
+}
+
+// wheel quadrature from whl_read(), one detent is 0 -> 1|2 -> 3 or back
+typedef struct {
+	int lastlast, last;
+	int count; // microframe counter for limiting wheel code rate
+} Whl_state;
+
+// only run wheel code every 4 microframes in high speed
+static inline int whl_due(Whl_state *w, const int hs_usb)
+{
+	const int due = !hs_usb || w->count == 0;
+	if (hs_usb)
+		w->count = (w->count + 1) & 3;
+	return due;
+}
+
+// returns the detents turned, -1, 0 or 1
+static inline int8_t whl_decode(Whl_state *w, const int whl_now)
+{
+	int8_t whl = 0;
+	if (whl_now != w->last) {
+		if (!((whl_now == 0 && w->last == 3) || (whl_now == 3 && w->last == 0))) {
+			if (whl_now == 0 && w->lastlast == 3) {
+				whl = (w->last == 1) ? -1 : (w->last == 2) ? 1 : 0;
+			} else if (whl_now == 3 && w->lastlast == 0) {
+				whl = (w->last == 1) ? 1 : (w->last == 2) ? -1 : 0;
+			}
+			w->lastlast = w->last;
+			w->last = whl_now;
+		}
+	}
+	return whl;
+}
+
+// a report the host never collected goes back into the backlog
+static inline void report_requeue(Motion_acc *acc, const Usb_packet *send)
+{
+	acc_add(acc, send->x, send->y, send->whl);
+}
+
+#define REPORT_NONE 0 // nothing new
+#define REPORT_SKIP 1 // skipped for the interval, nothing new
+#define REPORT_HELD 2 // skipped for the interval, new data held back
+#define REPORT_SEND 3 // *send is the next report
+
+// something the host hasn't seen yet
+static inline int report_pending(const Usb_packet *send, const Motion_acc *acc,
+		const uint8_t btn, const int resend)
+{
+	return resend || btn != send->btn || acc->whl || acc->x || acc->y;
+}
+
+// skip "skip" loops after each sent report, then send if there is anything
+// new. skip is a constant in each loop variant, so this folds away at 8kHz.
+static inline __attribute__((always_inline)) int report_next(int *count, const int skip,
+		Usb_packet *send, Motion_acc *acc, const uint8_t btn, const int resend)
+{
+	if (skip > 0 && *count > 0) {
+		(*count)--;
+		return report_pending(send, acc, btn, resend) ? REPORT_HELD : REPORT_SKIP;
+	}
+	if (!report_pending(send, acc, btn, resend))
+		return REPORT_NONE;
+	send->btn = btn;
+	send->whl = acc_take_whl(&acc->whl);
+	send->x = acc_take_xy(&acc->x);
+	send->y = acc_take_xy(&acc->y);
+	*count = skip;
+	return REPORT_SEND;
+}
@@ -0,0 +1,116 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+// event ring for a timeline of the main loop, with cycles_now() timestamps.
+// the host arms it with SET_REPORT USB_REPORT_ID_TRACE, and GET_REPORT
+// USB_REPORT_ID_TRACE stops it and returns it. tools/trace_json.c turns that
+// into a chrome trace (chrome://tracing, ui.perfetto.dev).
+// events are written by the main loop while PendSV is masked, and by the
+// control bottom half, so the two never interleave inside trace_ev().
+
+// record events. off, every trace_ev() is empty and the ring takes no RAM.
+//#define TRACE
+
+#include <stdint.h>
+
+enum {
+	TRACE_SOF, // loop woke up for a SOF, arg = frame number
+	TRACE_BURST_BEGIN, // sensor motion burst
+	TRACE_BURST_END, // arg8 = SQUAL
+	TRACE_BTN, // buttons changed, arg8 = new state
+	TRACE_WHL, // wheel detent, arg8 = int8 detents
+	TRACE_COMMIT_BEGIN, // report into EP1
+	TRACE_COMMIT_END,
+	TRACE_FLUSH, // last report flushed from the fifo
+	TRACE_LOOP_END, // end of the loop iteration
+	TRACE_CTRL_BEGIN, // control bottom half, arg = GINTSTS bits 4 (RXFLVL) to 19 (OEPINT)
+	TRACE_CTRL_END,
+	TRACE_SETUP, // setup packet, arg8 = bRequest, arg = wValue
+	TRACE_FLASH, // config_step started a flash op, arg8 = 1 for an erase, 0 for a word
+	TRACE_TYPES
+};
+
+typedef struct {
+	uint32_t cycles;
+	uint8_t type; // TRACE_*
+	uint8_t arg8;
+	uint16_t arg;
+} Trace_event;
+
+#define TRACE_LEN 1024 // power of two, 8kB, ~20ms of events at 8kHz
+
+// the GET_REPORT payload
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_TRACE
+	volatile uint8_t on;
+	uint8_t once; // stop when full, instead of keeping the last TRACE_LEN
+	uint8_t cycles_per_us;
+	uint32_t head; // events written since armed, the oldest is at head - TRACE_LEN
+	Trace_event ev[TRACE_LEN];
+} Trace;
+
+// SET_REPORT payload for USB_REPORT_ID_TRACE
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_TRACE
+	uint8_t on; // clear the ring and record, or stop
+	uint8_t once;
+} Usb_trace_report;
+
+// tools/trace_json.c only wants the types
+#ifndef TRACE_TYPES_ONLY
+#include "cycles.h"
+
+#ifdef TRACE
+extern Trace trace;
+
+// from the control bottom half
+static inline void trace_arm(const int on, const int once)
+{
+	trace.on = 0;
+	trace.head = 0;
+	trace.once = once;
+	trace.on = on;
+}
+#endif
+
+static inline void trace_ev(const uint8_t type, const uint8_t arg8, const uint16_t arg)
+{
+#ifdef TRACE
+	if (!trace.on)
+		return;
+	const uint32_t i = trace.head;
+	if (trace.once && i >= TRACE_LEN) {
+		trace.on = 0;
+		return;
+	}
+	trace.ev[i & (TRACE_LEN - 1)] = (Trace_event){.cycles = cycles_now(), .type = type, .arg8 = arg8, .arg = arg};
+	trace.head = i + 1;
+#else
+	(void)type;
+	(void)arg8;
+	(void)arg;
+#endif
+}
+#endif
@@ -23,10 +23,188 @@
 
 #pragma once
 
+// host tools define USB_TYPES_ONLY for the report layouts without the rest
+#ifndef USB_TYPES_ONLY
 #include "usbd_def.h"
+#include "cycles.h"
+#endif
+#include "motion.h"
+#include "config.h"
 
+// feature report ids for GET_REPORT, wValue = (HID_REPORT_TYPE_FEATURE << 8) | id
+// these are not declared in the report descriptor, read them with a raw control transfer
+#define USB_REPORT_ID_STATS 0x01
+#define USB_REPORT_ID_SCALE 0x02
+#define USB_REPORT_ID_CURVE 0x03
+#define USB_REPORT_ID_PROFILE 0x04
+#define USB_REPORT_ID_PROFILE_SEL 0x05
+#define USB_REPORT_ID_LIFT 0x06
+#define USB_REPORT_ID_SURFACE 0x07
+#define USB_REPORT_ID_BOOT 0x08
+#define USB_REPORT_ID_TRACE 0x09 // see trace.h
+
+// send EP1 IN reports by the OTG internal DMA from a report slot in DTCM, instead
+// of writing them to the fifo. this switches EP0 to DMA too, the core has no
+// per-endpoint choice. compare the two with commit_cycles and wire_cycles below.
+//#define USB_DMA
+
+// NVIC preemption priorities, lower is more urgent. TIM2 (delay_us wake-up) stays at 0.
+// the main loop raises BASEPRI to USB_PRIO_EP1 between SOF and the report commit,
+// so only the SOF top half can interrupt it there.
+#define USB_PRIO_SOF 1 // OTG_HS_IRQHandler: SOF, and pending the control bottom half
+#define USB_PRIO_EP1 2 // OTG_HS_EP1_IN_IRQHandler
+#define USB_PRIO_CTRL 15 // PendSV_Handler: EP0, reset, enumeration, suspend
+
+// transport health counters, filled in by the main loop and the usb interrupts
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_STATS
+	uint8_t loop; // main loop variant: USB_LOOP_HS | skip, or'd with USB_LOOP_GENERIC
+	uint8_t build; // USB_BUILD_*, so captures of different builds can't be mixed up
+	uint8_t _pad;
+	uint32_t sent; // reports written to the fifo
+	uint32_t flushed; // reports flushed from the fifo because the host did not collect them
+	uint32_t skipped; // skipped loops that held back new data for a later report
+	uint32_t sof_missed; // (micro)frames whose SOF the loop did not see
+	uint32_t ctrl; // control requests serviced while running
+	// cpu cycles, summed over all reports, divide by sent. these wrap after a few hours.
+	uint32_t commit_cycles; // filling and arming EP1 in the main loop
+	uint32_t wire_cycles; // from the end of the commit to EP1 transfer complete
+	uint32_t wire_max; // worst single commit to transfer complete
+	uint32_t loops; // main loop iterations
+	uint32_t loop_cycles; // from SOF wake-up to the end of the iteration, summed, divide by loops
+	uint32_t loop_max; // since the loop variant started
+	uint32_t lifts; // lift detections, see Motion_lift
+	uint32_t lift_zeroed; // loops whose sensor motion was dropped while lifted
+	uint32_t lift_saved; // of those, loops that would have sent a report for it
+	uint32_t sensor_fails; // health checks that read a wrong id
+	uint32_t sensor_resets; // sensor re-inits after HEALTH_FAILS of them in a row
+	uint32_t sensor_recover_cycles; // last detection to end of re-init
+	// SOF interrupt to the main loop running again, summed, divide by loops.
+	// interrupt entry and the wake-up from WFI, plus whatever held the loop off.
+	uint32_t wake_cycles;
+	uint32_t wake_max;
+	uint32_t wake_max_flash; // worst of the loops that started while the flash was busy
+	// control bottom half (PendSV). it only runs after the report commit, so
+	// what it costs the reports shows in wake_max. ctrl_wait_max is what the
+	// loop costs control requests: top half to bottom half running.
+	uint32_t ctrl_runs;
+	uint32_t ctrl_cycles; // summed, divide by ctrl_runs
+	uint32_t ctrl_max;
+	uint32_t ctrl_wait_max;
+	uint32_t flash_errors; // config writes that failed, see config_errors()
+} Usb_stats;
+
+// surface tracking quality for GET_REPORT, from the extended motion burst
+// the main loop reads every SURFACE_EVERY loops while not lifted.
+// the sums wrap, take differences between two reads and divide by samples.
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_SURFACE
+	uint8_t squal; // last sample from here to shutter
+	uint8_t raw_sum; // RawData_Sum
+	uint8_t raw_max, raw_min; // pixel values
+	uint8_t _pad;
+	uint16_t shutter;
+	uint32_t samples;
+	uint32_t squal_sum;
+	uint32_t raw_sum_sum;
+	uint32_t raw_max_sum, raw_min_sum;
+	uint32_t shutter_sum;
+} Usb_surface;
+
+// boot timeline for GET_REPORT, cycles_now() as each step finished.
+// the polls are bounded, a step that ran into its timeout sets its bit.
+enum {
+	BOOT_START, // cycles_init, always 0
+	BOOT_POWER, // supply above the PVD threshold
+	BOOT_CONFIG, // config read, boot buttons handled
+	BOOT_USB_PHY, // PHY PLL running and core reset done
+	BOOT_USB_MODE, // core in device mode
+	BOOT_USB_CONNECT, // pull-up on
+	BOOT_USB_CONFIGURED, // host set the configuration
+	BOOT_SENSOR, // paw3399_init done
+	BOOT_LOOP, // main loop entered
+	BOOT_REPORT, // first report committed
+	BOOT_MARKS
+};
+
+#define BOOT_NO_HANDOFF 0xFF
+
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_BOOT
+	uint8_t handoff; // HANDOFF_REASON_*, or BOOT_NO_HANDOFF
+	uint16_t timeouts; // bit per BOOT_*
+	uint32_t loader_us; // bootloader entry to app main
+	uint32_t at[BOOT_MARKS];
+} Usb_boot;
+
+#define USB_LOOP_HS      (1 << 4)
+#define USB_LOOP_GENERIC (1 << 7)
+
+#define USB_BUILD_DMA   (1 << 0) // USB_DMA
+#define USB_BUILD_TRACE (1 << 1) // TRACE in trace.h
+
+// SET_REPORT payload for USB_REPORT_ID_SCALE, see Motion_scale in motion.h
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_SCALE
+	uint8_t on;
+	int16_t m[2][2]; // Q2.14, (x_out, y_out) = m * (x_in, y_in)
+} Usb_scale_report;
+
+// SET_REPORT payload for USB_REPORT_ID_CURVE, see Motion_curve in motion.h
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_CURVE
+	uint8_t on;
+	uint8_t shift; // up to CURVE_SHIFT_MAX
+	uint8_t _pad;
+	uint16_t gain[CURVE_LEN];
+} Usb_curve_report;
+
+// SET_REPORT payload for USB_REPORT_ID_LIFT, see Motion_lift in motion.h
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_LIFT
+	uint8_t on;
+	uint8_t below, from; // from >= below
+	uint8_t debounce; // at least 1
+} Usb_lift_report;
+
+// SET_REPORT payload for USB_REPORT_ID_PROFILE
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_PROFILE
+	uint8_t slot; // below PROFILE_NUM
+	uint8_t save; // also store it in flash, otherwise it's lost on reset
+	uint8_t _pad;
+	Profile p;
+} Usb_profile_report;
+
+// SET_REPORT payload for USB_REPORT_ID_PROFILE_SEL
+typedef struct {
+	uint8_t report_id; // USB_REPORT_ID_PROFILE_SEL
+	uint8_t slot; // switch to it in the next microframe. PROFILE_NONE only affects save
+	uint8_t save; // also select it on boot
+} Usb_profile_sel_report;
+
+#ifndef USB_TYPES_ONLY
 extern USBD_HandleTypeDef USBD_Device;
+extern Usb_stats usb_stats;
+extern Usb_surface usb_surface;
+extern Usb_boot usb_boot;
+
+static inline void boot_mark(const int step, const int ok)
+{
+	usb_boot.at[step] = cycles_now();
+	if (!ok)
+		usb_boot.timeouts |= 1 << step;
+}
+extern uint32_t usb_commit_at; // cycles_now() at the end of the last EP1 commit
+extern volatile uint32_t usb_sof_at; // cycles_now() in the SOF top half
 
 void usb_init(int hs_usb);
 
 void usb_wait_configured(void);
+
+// no control request waiting for the bottom half or half way through
+int usb_ctrl_idle(void);
+
+// called from the control bottom half (PendSV) when the host has sent a feature report
+void usb_set_feature(uint8_t report_id, const uint8_t *buf, uint32_t len);
+#endif
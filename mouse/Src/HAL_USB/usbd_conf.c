@@ -572,7 +572,15 @@ USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev,
   }
 
   __HAL_LOCK(hpcd);
-  (void)USB_ActivateEndpoint(hpcd->Instance, ep);
+  /* EP1 IN gets its own interrupt line, see OTG_HS_EP1_IN_IRQHandler */
+  if ((hpcd->Init.use_dedicated_ep1 == 1U) && (ep->num == 1U) && (ep->is_in != 0U))
+  {
+    (void)USB_ActivateDedicatedEndpoint(hpcd->Instance, ep);
+  }
+  else
+  {
+    (void)USB_ActivateEndpoint(hpcd->Instance, ep);
+  }
   __HAL_UNLOCK(hpcd);
 
   return ret;
@@ -633,13 +641,18 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
   ep->is_in = 0U;
   ep->num = ep_addr & EP_ADDR_MSK;
 
+  if (hpcd->Init.dma_enable == 1U)
+  {
+    ep->dma_addr = (uint32_t)pBuf;
+  }
+
   if ((ep_addr & EP_ADDR_MSK) == 0U)
   {
-    (void)USB_EP0StartXfer(hpcd->Instance, ep);
+    (void)USB_EP0StartXfer(hpcd->Instance, ep, (uint8_t)hpcd->Init.dma_enable);
   }
   else
   {
-    (void)USB_EPStartXfer(hpcd->Instance, ep);
+    (void)USB_EPStartXfer(hpcd->Instance, ep, (uint8_t)hpcd->Init.dma_enable);
   }
 
   return HAL_OK;
@@ -670,13 +683,18 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
   ep->is_in = 1U;
   ep->num = ep_addr & EP_ADDR_MSK;
 
+  if (hpcd->Init.dma_enable == 1U)
+  {
+    ep->dma_addr = (uint32_t)pBuf;
+  }
+
   if ((ep_addr & EP_ADDR_MSK) == 0U)
   {
-    (void)USB_EP0StartXfer(hpcd->Instance, ep);
+    (void)USB_EP0StartXfer(hpcd->Instance, ep, (uint8_t)hpcd->Init.dma_enable);
   }
   else
   {
-    (void)USB_EPStartXfer(hpcd->Instance, ep);
+    (void)USB_EPStartXfer(hpcd->Instance, ep, (uint8_t)hpcd->Init.dma_enable);
   }
 
   return HAL_OK;
@@ -717,7 +735,7 @@ USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   (void)USB_EPSetStall(hpcd->Instance, ep);
   if ((ep_addr & EP_ADDR_MSK) == 0U)
   {
-    (void)USB_EP0_OutStart(hpcd->Instance);
+    (void)USB_EP0_OutStart(hpcd->Instance, (uint8_t)hpcd->Init.dma_enable, (uint8_t *)hpcd->Setup);
   }
   __HAL_UNLOCK(hpcd);
 
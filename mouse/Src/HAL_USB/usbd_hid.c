@@ -46,6 +46,9 @@ EndBSPDependencies */
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_hid.h"
 #include "usbd_ctlreq.h"
+#include "usb.h"
+#include "report.h"
+#include "trace.h"
 
 
 /** @addtogroup STM32_USB_DEVICE_LIBRARY
@@ -100,7 +103,7 @@ USBD_ClassTypeDef USBD_HID = {
   USBD_HID_DeInit,
   USBD_HID_Setup,
   NULL,              /* EP0_TxSent */
-  NULL,              /* EP0_RxReady */
+  USBD_HID_EP0_RxReady, /* EP0_RxReady */
   USBD_HID_DataIn,   /* DataIn */
   NULL,              /* DataOut */
   NULL,              /* SOF */
@@ -188,45 +191,9 @@ __ALIGN_BEGIN static uint8_t USBD_HID_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_
   0x00,
 };
 
-__ALIGN_BEGIN static uint8_t HID_MOUSE_ReportDesc[HID_MOUSE_REPORT_DESC_SIZE] __ALIGN_END = {
-	0x05, 0x01,             // Usage Page (Generic Desktop)
-	0x09, 0x02,             // Usage (Mouse)
-	0xA1, 0x01,             // Collection (Application)
-	0x05, 0x09,             //   Usage Page (Button)
-	0x19, 0x01,             //   Usage Minimum (Button #1)
-	0x29, 0x03,             //   Usage Maximum (Button #3)
-	0x15, 0x00,             //   Logical Minimum (0)
-	0x25, 0x01,             //   Logical Maximum (1)
-	0x95, 0x03,             //   Report Count (3)
-	0x75, 0x01,             //   Report Size (1)
-	0x81, 0x02,             //   Input (Data, Variable, Absolute)
-	0x95, 0x01,             //   Report Count (1)
-	0x75, 0x05,             //   Report Size (5)
-	0x81, 0x03,             //   Input (Constant) // Byte 1
-
-	0x05, 0x01,             //   Usage Page (Generic Desktop)
-
-	0x09, 0x38,             //   Usage (Wheel)
-	0x15, 0x81,             //   Logical Minimum (-127)
-	0x25, 0x7F,             //   Logical Maximum (127)
-	0x35, 0x81,             //   Physical Minimum (-127)
-	0x45, 0x7F,             //   Physical Maximum (127)
-	0x75, 0x08,             //   Report Size (8)
-	0x95, 0x01,             //   Report Count (1)
-	0x81, 0x06,             //   Input (Data, Variable, Relative) // Byte 2
-
-	0x09, 0x30,             //   Usage (X)
-	0x09, 0x31,             //   Usage (Y)
-	0x16, 0x01, 0x80,       //   Logical Minimum (-32,767)
-	0x26, 0xFF, 0x7F,       //   Logical Maximum (32,767)
-	0x36, 0x01, 0x80,       //   Physical Minimum (-32,767)
-	0x46, 0xFF, 0x7F,       //   Physical Maximum (32,767)
-	0x75, 0x10,             //   Report Size (16),
-	0x95, 0x02,             //   Report Count (2),
-	0x81, 0x06,             //   Input (Data, Variable, Relative) // Byte 3-6
-
-	0xC0                    // End Collection
-};
+// see report.h, shared with tools/uhid_bridge.c
+__ALIGN_BEGIN static uint8_t HID_MOUSE_ReportDesc[HID_MOUSE_REPORT_DESC_SIZE] __ALIGN_END = HID_MOUSE_REPORT_DESC;
+
 //  0x05,   0x01,
 //  0x09,   0x02,
 //  0xA1,   0x01,
@@ -275,6 +242,11 @@ __ALIGN_BEGIN static uint8_t HID_MOUSE_ReportDesc[HID_MOUSE_REPORT_DESC_SIZE] __
 //  0x01,   0xc0
 //};
 
+/* data stage of SET_REPORT(Feature) */
+__ALIGN_BEGIN static uint8_t HID_FeatureBuf[HID_FEATURE_BUF_SIZE] __ALIGN_END;
+static uint8_t HID_FeatureId;
+static uint16_t HID_FeatureLen;
+
 /**
   * @}
   */
@@ -386,6 +358,55 @@ uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
       (void)USBD_CtlSendData(pdev, (uint8_t *)&hhid->IdleState, 1U);
       break;
 
+    case HID_REQ_SET_REPORT:
+      if (((req->wValue >> 8) == HID_REPORT_TYPE_FEATURE) &&
+          (req->wLength != 0U) && (req->wLength <= HID_FEATURE_BUF_SIZE))
+      {
+        HID_FeatureId = (uint8_t)req->wValue;
+        HID_FeatureLen = req->wLength;
+        (void)USBD_CtlPrepareRx(pdev, HID_FeatureBuf, req->wLength);
+      }
+      else
+      {
+        USBD_CtlError(pdev, req);
+        ret = USBD_FAIL;
+      }
+      break;
+
+    case HID_REQ_GET_REPORT:
+      if (req->wValue == ((HID_REPORT_TYPE_FEATURE << 8) | USB_REPORT_ID_STATS))
+      {
+        /* snapshot, the main loop keeps counting while the fifo is filled */
+        static Usb_stats stats;
+        stats = usb_stats;
+        stats.flash_errors = config_errors();
+        (void)USBD_CtlSendData(pdev, (uint8_t *)&stats, MIN(sizeof(stats), req->wLength));
+      }
+      else if (req->wValue == ((HID_REPORT_TYPE_FEATURE << 8) | USB_REPORT_ID_SURFACE))
+      {
+        static Usb_surface surface;
+        surface = usb_surface;
+        (void)USBD_CtlSendData(pdev, (uint8_t *)&surface, MIN(sizeof(surface), req->wLength));
+      }
+      else if (req->wValue == ((HID_REPORT_TYPE_FEATURE << 8) | USB_REPORT_ID_BOOT))
+      {
+        (void)USBD_CtlSendData(pdev, (uint8_t *)&usb_boot, MIN(sizeof(usb_boot), req->wLength));
+      }
+#ifdef TRACE
+      else if (req->wValue == ((HID_REPORT_TYPE_FEATURE << 8) | USB_REPORT_ID_TRACE))
+      {
+        /* stopped, so it stays as it is while it goes out */
+        trace.on = 0;
+        (void)USBD_CtlSendData(pdev, (uint8_t *)&trace, MIN(sizeof(trace), req->wLength));
+      }
+#endif
+      else
+      {
+        USBD_CtlError(pdev, req);
+        ret = USBD_FAIL;
+      }
+      break;
+
     default:
       USBD_CtlError(pdev, req);
       ret = USBD_FAIL;
@@ -539,6 +560,22 @@ uint8_t USBD_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 }
 
 
+/**
+  * @brief  USBD_HID_EP0_RxReady
+  *         handle the data stage of SET_REPORT
+  * @param  pdev: device instance
+  * @retval status
+  */
+uint8_t USBD_HID_EP0_RxReady(USBD_HandleTypeDef *pdev)
+{
+  UNUSED(pdev);
+
+  usb_set_feature(HID_FeatureId, HID_FeatureBuf, HID_FeatureLen);
+
+  return (uint8_t)USBD_OK;
+}
+
+
 /**
 * @brief  DeviceQualifierDescriptor
 *         return Device Qualifier descriptor
@@ -23,25 +23,79 @@
 
 #include <stdint.h>
 #include "anim.h"
+#include "itcm.h"
+
+// the queue holds run-length commands (reps x sequence), expanded one
+// step at a time by anim_read, so nothing is copied per repetition.
+#define QUEUE_SIZE 32 // power of 2
+struct Anim_cmd {
+	const struct Anim *seq;
+	uint16_t len_seq;
+	uint16_t reps;
+};
+static struct Anim_cmd queue[QUEUE_SIZE];
+static uint32_t queue_head = 0, queue_tail = 0; // free running, masked on access
+
+// playback state of the command at the head of the queue
+static int seq_i = 0; // index in seq
+static uint32_t reps_left = 0;
+static uint32_t len_left = 0; // of seq[seq_i], 0 if the queue is empty
+static struct Xy xy_cur;
 
-#define BUF_SIZE 128
-static struct Anim buf[BUF_SIZE] = {0}; // circular fifo buffer
-static int anim_buf_head = 0, anim_buf_tail = 0; // tail is one past end index
 static int anim_time_scale = 1; // slow down animation by this factor
+static int tick = 0;
 
 void anim_set_scale(int scale)
 {
 	anim_time_scale = scale;
 }
 
-void anim_add(int reps, int len_seq, const struct Anim seq[])
+__ITCM static void cmd_start(void)
+{
+	if (queue_head == queue_tail) {
+		len_left = 0;
+		return;
+	}
+	const struct Anim_cmd *c = &queue[queue_head % QUEUE_SIZE];
+	seq_i = 0;
+	reps_left = c->reps;
+	len_left = c->seq[0].len;
+	xy_cur = c->seq[0].xy;
+}
+
+// seq[seq_i] is done, move on to the next step
+__ITCM static void cmd_step(void)
 {
-	for (int i = 0; i < reps; i++) {
-		for (int j = 0; j < len_seq; j++) {
-			buf[anim_buf_tail] = seq[j];
-			anim_buf_tail = (anim_buf_tail + 1) % BUF_SIZE;
+	const struct Anim_cmd *c = &queue[queue_head % QUEUE_SIZE];
+	if (++seq_i == c->len_seq) {
+		seq_i = 0;
+		if (--reps_left == 0) {
+			queue_head++;
+			cmd_start();
+			return;
 		}
 	}
+	len_left = c->seq[seq_i].len;
+	xy_cur = c->seq[seq_i].xy;
+}
+
+static uint32_t queue_free(void)
+{
+	return QUEUE_SIZE - (queue_tail - queue_head);
+}
+
+int anim_add(int reps, int len_seq, const struct Anim seq[])
+{
+	if (reps <= 0 || len_seq <= 0)
+		return 1;
+	if (reps > UINT16_MAX || len_seq > UINT16_MAX || queue_free() == 0)
+		return 0;
+	queue[queue_tail % QUEUE_SIZE] = (struct Anim_cmd){
+		.seq = seq, .len_seq = len_seq, .reps = reps};
+	queue_tail++;
+	if (len_left == 0)
+		cmd_start();
+	return 1;
 }
 
 
@@ -52,56 +106,71 @@ void anim_add(int reps, int len_seq, const struct Anim seq[])
 #define L_SEG ANIM(LEN_SEG / SPEED_SLOW, -SPEED_SLOW,  0)
 #define R_SEG ANIM(LEN_SEG / SPEED_SLOW,  SPEED_SLOW,  0)
 
+// digit glyphs, the last step is the shift to the next digit.
+// not const, they are played from RAM, see anim_add.
+static struct Anim glyph_0[] = {D_SEG, D_SEG, R_SEG, U_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, 0)};
+static struct Anim glyph_1[] = {D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)};
+static struct Anim glyph_2[] = {R_SEG, D_SEG, L_SEG, D_SEG, R_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)};
+static struct Anim glyph_3[] = {R_SEG, D_SEG, L_SEG, R_SEG, D_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG*2)};
+static struct Anim glyph_4[] = {D_SEG, R_SEG, U_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)};
+static struct Anim glyph_5[] = {L_SEG, D_SEG, R_SEG, D_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG*2)};
+static struct Anim glyph_6[] = {L_SEG, D_SEG, D_SEG, R_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG)};
+static struct Anim glyph_7[] = {R_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)};
+static struct Anim glyph_8[] = {D_SEG, R_SEG, D_SEG, L_SEG, U_SEG, R_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, 0)};
+static struct Anim glyph_9[] = {L_SEG, D_SEG, R_SEG, U_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)};
+static struct Anim glyph_right[] = {ANIM(1, LEN_SEG, 0)};
+static struct Anim glyph_pause[] = {ANIM(300, 0, 0)};
+
+#define GLYPH(g) {g, sizeof(g)/sizeof(g[0])}
+static const struct {
+	const struct Anim *seq;
+	int len;
+} glyphs[] = {
+	GLYPH(glyph_0), GLYPH(glyph_1), GLYPH(glyph_2), GLYPH(glyph_3), GLYPH(glyph_4),
+	GLYPH(glyph_5), GLYPH(glyph_6), GLYPH(glyph_7), GLYPH(glyph_8), GLYPH(glyph_9)
+};
+static const int right[] = {0, 1, 0, 0, 0, 1, 1, 0, 0, 1}; // 1, 5, 6, 9 start from top right.
+
 void anim_num(const uint16_t x)
 {
-	const struct Anim *symbols[] = {
-		(struct Anim[]){D_SEG, D_SEG, R_SEG, U_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, 0)}, // 0
-		(struct Anim[]){D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)}, // 1
-		(struct Anim[]){R_SEG, D_SEG, L_SEG, D_SEG, R_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)}, // 2
-		(struct Anim[]){R_SEG, D_SEG, L_SEG, R_SEG, D_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG*2)}, // 3
-		(struct Anim[]){D_SEG, R_SEG, U_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)}, // 4
-		(struct Anim[]){L_SEG, D_SEG, R_SEG, D_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG*2)}, //5
-		(struct Anim[]){L_SEG, D_SEG, D_SEG, R_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, -LEN_SEG)}, // 6
-		(struct Anim[]){R_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)}, // 7
-		(struct Anim[]){D_SEG, R_SEG, D_SEG, L_SEG, U_SEG, R_SEG, U_SEG, L_SEG, ANIM(1, HSPACE, 0)}, // 8
-		(struct Anim[]){L_SEG, D_SEG, R_SEG, U_SEG, D_SEG, D_SEG, ANIM(1, HSPACE - LEN_SEG, -LEN_SEG*2)} // 9
-	};
-	const int lengths[] = {7, 3, 6, 7, 6, 6, 7, 4, 9, 7};
-	const int right[] = {0, 1, 0, 0, 0, 1, 1, 0, 0, 1}; // 1, 5, 6, 9 start from top right.
-
 	const int powers[] = {10000, 1000, 100, 10, 1};
 	const int len_powers = 5;
+
+	// all or nothing, at most 4 commands per digit
+	if (queue_free() < (uint32_t)(4 * len_powers))
+		return;
+
 	int n = 0; // which number we're on, from left to right
 	for (int i = 0; i < len_powers; i++) {
 		int d = (x / powers[i]) % 10;
 		if (n == 0 && d > 0) n = 1;
 		if (n > 0 || i == len_powers - 1) {
+			const struct Anim *g = glyphs[d].seq;
+			const int len = glyphs[d].len;
 			if (right[d] && n > 1) // start on right side for 1, 5, 6, 9
-				anim_add(1, 1, (struct Anim[]){ANIM(1, LEN_SEG, 0)});
-			anim_add(1, lengths[d] - 1, symbols[d]); // symbol apart from shift at the end
+				anim_add(1, 1, glyph_right);
+			anim_add(1, len - 1, g); // symbol apart from shift at the end
 			if (i < len_powers - 1) { // except for last digit, pause and then shift
-				anim_pause(300);
-				anim_add(1, 1, symbols[d] + lengths[d] - 1); // including the shift after a pause
+				anim_add(1, 1, glyph_pause);
+				anim_add(1, 1, g + len - 1); // including the shift after a pause
 			}
 			n++;
 		}
 	}
 }
 
-struct Xy anim_read(void)
+__ITCM struct Xy anim_read(void)
 {
-	if (anim_buf_head == anim_buf_tail)
+	if (len_left == 0)
 		return (struct Xy){0};
 
-	static int count = 0;
-	count = (count + 1) % anim_time_scale;
-	if (count > 0)
+	// step through animation only after anim_time_scale calls to anim_read()
+	if (--tick > 0)
 		return (struct Xy){0};
+	tick = anim_time_scale;
 
-	// step through animation only after anim_time_scale calls to anim_read()
-	struct Xy ret = buf[anim_buf_head].xy;
-	buf[anim_buf_head].len--;
-	if (buf[anim_buf_head].len == 0)
-		anim_buf_head = (anim_buf_head + 1) % BUF_SIZE;
+	const struct Xy ret = xy_cur;
+	if (--len_left == 0)
+		cmd_step();
 	return ret;
 }
@@ -21,16 +21,115 @@
  * SOFTWARE.
  */
 
+#include <stddef.h>
 #include "config.h"
 #include "stm32f7xx.h"
+#include "itcm.h"
+#include "trace.h"
 
-// use flash sector 1, the 2nd 16kb (0x4000) sector
+// use flash sector 1, the 2nd 16kb (0x4000) sector. it is the only one
+// free: sector 0 is the bootloader, sectors 2 and 3 the app.
 #define CONFIG_SECTOR_NUM  1
 #define CONFIG_SECTOR_BASE (FLASHAXI_BASE + CONFIG_SECTOR_NUM*0x4000) // 0x08004000
 #define CONFIG_SECTOR      ((__IO uint16_t *)CONFIG_SECTOR_BASE)
 #define CONFIG_SECTOR_SIZE (0x4000 * sizeof(uint8_t)/sizeof(uint16_t))
 
-static int config_index = -1; // set on first call to read_config
+// the sector is two logs, filled from their start and only erased together
+// when one is full. the first 12kb hold the magic and then one word per
+// Config save, the Config with the selected profile. the last 4kb hold a
+// Profile_record per profile store, of that slot only. boot binary-searches
+// both logs for their ends (12 and 6 reads), takes the last good config word
+// and walks the profile records back to the last good one of each slot.
+// a word or record that a reset or a flash error cut short fails its check
+// and is passed over.
+// the erase compacts: the current Config and every stored profile go in
+// again, so the config log has about 3000 saves between erases. with a
+// single sector the erase and the writes after it are the one window where
+// not everything is in flash. a copy in RAM (Config_rescue) covers a reset
+// there, a power loss there still falls back to config_default.
+#define JOURNAL_MAGIC   0xC0F1A7E5 // bit 15 set in both halves, so never two legacy Configs
+#define JOURNAL         ((const __IO uint32_t *)CONFIG_SECTOR_BASE)
+#define JOURNAL_CONFIGS (0x3000 / (int)sizeof(uint32_t)) // words, the magic first
+#define JOURNAL_VOID    0 // a word or record head that failed to program
+
+// a log word: tag, profile_sel (0xF for none), check of the rest, Config
+#define REC_TAG_Pos    28
+#define REC_ARG_Pos    24
+#define REC_CHECK_Pos  16
+#define REC_CHECK_Msk  (0xFFU << REC_CHECK_Pos)
+#define REC_CONFIG     0xC
+#define REC_PROFILE    0xA // the head of a Profile_record, slot and no data
+static_assert(PROFILE_NUM < 0xF, "profile_sel doesn't fit a log word");
+
+typedef struct {
+	uint32_t head;
+	Profile p;
+	uint32_t crc; // of head and p, written last
+} Profile_record;
+
+#define JOURNAL_PROFILE  ((const Profile_record *)(CONFIG_SECTOR_BASE + 0x3000))
+#define JOURNAL_PROFILES ((int)(0x1000 / sizeof(Profile_record)))
+static_assert(JOURNAL_PROFILES >= 2*PROFILE_NUM, "compaction leaves no room for profile stores");
+
+// everything persisted, as the logs hold it after compaction
+typedef struct {
+	Config cfg;
+	uint8_t profile_sel;
+	uint8_t profile_valid; // bit per slot
+	Profile profiles[PROFILE_NUM];
+	uint32_t crc; // of everything above
+} Config_snapshot;
+static_assert(sizeof(Config_snapshot) % sizeof(uint32_t) == 0, "Config_snapshot not word sized");
+static_assert(PROFILE_NUM <= 8, "profile_valid too small");
+
+// everything persisted, from before the erase until the compaction is done,
+// kept up with every log write in between. in the RESCUE region of both
+// linker scripts, which no startup clears and the bootloader doesn't use, so
+// it survives a reset into the bootloader and back. RAM is random after
+// power on, hence the magic and the crc.
+#define RESCUE_MAGIC 0x52455343 // "RESC"
+
+typedef struct {
+	uint32_t magic;
+	Config_snapshot snap;
+} Config_rescue;
+static_assert(sizeof(Config_rescue) <= 1024, "Config_rescue bigger than RESCUE");
+
+static Config_rescue rescue __attribute__((section(".rescue")));
+
+// flash errors. a failed op is retried, CONFIG_TRIES in a row give up until reset.
+#define FLASH_SR_ERRORS (FLASH_SR_OPERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+		FLASH_SR_PGPERR | FLASH_SR_ERSERR)
+#define CONFIG_TRIES 3
+
+static int config_loaded = 0; // set on first call to read_config
+static Config config_cur;
+
+static Profile profiles[PROFILE_NUM];
+static uint32_t profile_valid = 0; // bit per slot
+static uint8_t profile_sel = PROFILE_NONE;
+
+static int journal_config = 1; // first free config word, after the magic. JOURNAL_CONFIGS if full
+static int journal_profile = 0; // first free profile record, JOURNAL_PROFILES if full
+static int journal_magic = 0; // magic is programmed
+static int journal_erase = 0; // erase before the next write
+static const uint32_t journal_magic_word = JOURNAL_MAGIC;
+static const uint32_t journal_void_word = JOURNAL_VOID;
+
+// queued writes, see config_step
+enum { WR_IDLE, WR_ERASE, WR_MAGIC, WR_CONFIG, WR_PROFILE, WR_VOID };
+static int dirty = 0; // Config or profile_sel
+static uint32_t dirty_profiles = 0; // bit per slot
+static int wr_state = WR_IDLE;
+static Profile_record wr_rec; // copy of the word or record being written
+static __IO uint32_t *wr_head; // its place in flash
+static const uint32_t *wr_src;
+static __IO uint32_t *wr_dst;
+static uint32_t wr_left = 0; // words
+static int wr_erase = 0;
+static uint32_t wr_errors = 0; // since boot
+static int wr_tries = 0; // failed ops since the last complete write
+static int wr_broken = 0; // gave up
 
 const Config config_default = (
 		0*CONFIG_ANGLE_SNAP_ON |
@@ -51,34 +150,26 @@ static void flash_lock(void)
 	FLASH->CR |= FLASH_CR_LOCK;
 }
 
-static void flash_busy_wait(void)
+// clears the error flags of the last op, which would fail the next one.
+// returns the flags.
+static inline uint32_t flash_errors(void)
 {
-	while ((FLASH->SR & FLASH_SR_BSY) != 0);
-}
-
-static void flash_prog_u16(__IO uint16_t *addr, const uint16_t data)
-{
-	flash_busy_wait();
-	MODIFY_REG(FLASH->CR,
-			FLASH_CR_PSIZE,
-			_VAL2FLD(FLASH_CR_PSIZE, 0b01) | FLASH_CR_PG); // 0b01 for 16-bit
-	*addr = data;
-	__DSB();
-	flash_busy_wait();
-	FLASH->CR &= ~FLASH_CR_PG;
+	const uint32_t err = FLASH->SR & FLASH_SR_ERRORS;
+	if (err != 0) {
+		FLASH->SR = err; // write 1 to clear
+		wr_errors++;
+	}
+	return err;
 }
 
-static void flash_sector_erase(int sector)
+// hardware crc unit, crc-32 (ethernet polynomial), len a multiple of 4
+static uint32_t crc32(const void *buf, const uint32_t len)
 {
-	flash_busy_wait();
-	// assume voltage range 2.7 - 3.6V for PSIZE (see ref manual pg 71)
-	MODIFY_REG(FLASH->CR,
-			FLASH_CR_PSIZE | FLASH_CR_SNB,
-			_VAL2FLD(FLASH_CR_PSIZE, 0b10) | _VAL2FLD(FLASH_CR_SNB, sector) | FLASH_CR_SER);
-	FLASH->CR |= FLASH_CR_STRT;
-	__DSB();
-	flash_busy_wait();
-	FLASH->CR &= ~(FLASH_CR_SNB | FLASH_CR_SER);
+	const uint32_t *w = buf;
+	CRC->CR = CRC_CR_RESET;
+	for (uint32_t i = 0; i < len / sizeof(uint32_t); i++)
+		CRC->DR = w[i];
+	return CRC->DR;
 }
 
 // assumes all programmed bytes of a are before the empty bytes.
@@ -98,28 +189,319 @@ static int index_highest(const __IO uint16_t *a, const int len)
 	return start;
 }
 
+// number of programmed words in a log of n entries stride words apart,
+// they are contiguous from the first
+static int journal_count(const __IO uint32_t *log, const int n, const int stride)
+{
+	int start = 0;
+	int end = n + 1;
+	while (start + 1 < end) { // binary search
+		int mid = (start + end)/2;
+		if (log[(mid - 1)*stride] != 0xFFFFFFFF)
+			start = mid;
+		else
+			end = mid;
+	}
+	return start;
+}
+
+static uint32_t rec_word(const uint32_t tag, const uint32_t arg, const uint16_t data)
+{
+	const uint32_t w = tag << REC_TAG_Pos | (arg & 0xF) << REC_ARG_Pos | data;
+	return w | (crc32(&w, sizeof(w)) & 0xFF) << REC_CHECK_Pos;
+}
+
+static int rec_ok(const uint32_t w, const uint32_t tag)
+{
+	const uint32_t rest = w & ~REC_CHECK_Msk;
+	return w >> REC_TAG_Pos == tag &&
+			((w & REC_CHECK_Msk) >> REC_CHECK_Pos) == (crc32(&rest, sizeof(rest)) & 0xFF);
+}
+
+static void snapshot_make(Config_snapshot *s)
+{
+	s->cfg = config_cur;
+	s->profile_sel = profile_sel;
+	s->profile_valid = profile_valid;
+	for (int i = 0; i < PROFILE_NUM; i++)
+		s->profiles[i] = profiles[i];
+	s->crc = crc32(s, offsetof(Config_snapshot, crc));
+}
+
+static void snapshot_use(const Config_snapshot *s)
+{
+	config_cur = s->cfg;
+	profile_sel = s->profile_sel;
+	profile_valid = s->profile_valid;
+	for (int i = 0; i < PROFILE_NUM; i++)
+		profiles[i] = s->profiles[i];
+}
+
+static int rescue_ok(void)
+{
+	return rescue.magic == RESCUE_MAGIC &&
+			crc32(&rescue.snap, offsetof(Config_snapshot, crc)) == rescue.snap.crc;
+}
+
+// returns 0 if the journal holds no good config word
+static int journal_load(void)
+{
+	journal_magic = 1;
+	journal_config = journal_count(JOURNAL, JOURNAL_CONFIGS, 1);
+	journal_profile = journal_count(&JOURNAL_PROFILE->head, JOURNAL_PROFILES,
+			sizeof(Profile_record) / sizeof(uint32_t));
+
+	// the newest records, the last ones written, are normally good
+	uint32_t found = 0;
+	for (int i = journal_profile - 1; i >= 0 && found != (1U << PROFILE_NUM) - 1; i--) {
+		const Profile_record *r = &JOURNAL_PROFILE[i];
+		const uint32_t slot = (r->head >> REC_ARG_Pos) & 0xF;
+		if (!rec_ok(r->head, REC_PROFILE) || slot >= PROFILE_NUM || (found & (1 << slot)) ||
+				crc32(r, offsetof(Profile_record, crc)) != r->crc)
+			continue;
+		found |= 1 << slot;
+		profiles[slot] = r->p;
+	}
+	profile_valid = found;
+
+	for (int i = journal_config - 1; i > 0; i--) { // 0 is the magic
+		const uint32_t w = JOURNAL[i];
+		if (!rec_ok(w, REC_CONFIG))
+			continue;
+		const uint8_t sel = (w >> REC_ARG_Pos) & 0xF;
+		config_cur = (Config)w;
+		profile_sel = sel < PROFILE_NUM ? sel : PROFILE_NONE;
+		return 1;
+	}
+	return 0;
+}
+
 Config config_read(void)
 {
-	if (config_index == -1) { // first call to function
-		config_index = index_highest(CONFIG_SECTOR, CONFIG_SECTOR_SIZE);
-		// write default cfg if sector is completely empty
-		if (config_index == 0 && CONFIG_SECTOR[config_index] == 0xFFFF) {
-			flash_unlock();
-			flash_prog_u16(&CONFIG_SECTOR[config_index], config_default);
-			flash_lock();
+	if (!config_loaded) { // first call to function
+		config_loaded = 1;
+		RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+		FLASH->SR = FLASH_SR_ERRORS; // left over from before the reset
+		const uint32_t magic = JOURNAL[0];
+		int loaded = 0;
+		if (magic == JOURNAL_MAGIC) {
+			loaded = journal_load();
+			// nothing usable, e.g. an interrupted erase. start over.
+			if (!loaded && (journal_config > 1 || journal_profile > 0))
+				journal_erase = 1;
+		} else if (magic != 0xFFFFFFFF) {
+			// earlier firmware kept a log of Config halfwords
+			config_cur = CONFIG_SECTOR[index_highest(CONFIG_SECTOR, CONFIG_SECTOR_SIZE)];
+			journal_erase = 1;
+			loaded = 1;
+			dirty = 1;
+		}
+		// a reset came between the erase and the end of the compaction. the
+		// rescue copy is as new as anything written since, and stays until
+		// it is all written again.
+		if (rescue_ok()) {
+			snapshot_use(&rescue.snap);
+			loaded = 1;
+			dirty = 1;
+			dirty_profiles = profile_valid;
+		} else {
+			rescue.magic = 0;
+		}
+		if (!loaded) {
+			config_cur = config_default;
+			dirty = 1;
 		}
 	}
-	return (Config){CONFIG_SECTOR[config_index]};
+	return config_cur;
+}
+
+uint32_t config_errors(void)
+{
+	return wr_errors;
 }
 
 void config_write(Config cfg)
 {
-	config_index++;
-	flash_unlock();
-	if (config_index == CONFIG_SECTOR_SIZE) {
-		config_index = 0;
-		flash_sector_erase(CONFIG_SECTOR_NUM);
+	config_cur = cfg;
+	dirty = 1;
+}
+
+const Profile *config_profile(const int slot)
+{
+	return (profile_valid & (1 << slot)) ? &profiles[slot] : NULL;
+}
+
+uint8_t config_profile_selected(void)
+{
+	return profile_sel;
+}
+
+void config_profile_store(const int slot, const Profile *p)
+{
+	profiles[slot] = *p;
+	profile_valid |= 1 << slot;
+	dirty_profiles |= 1 << slot;
+}
+
+void config_profile_select(const uint8_t slot)
+{
+	profile_sel = slot;
+	dirty = 1;
+}
+
+static void wr_words(__IO uint32_t *dst, const uint32_t *src, const uint32_t n)
+{
+	wr_dst = dst;
+	wr_src = src;
+	wr_left = n;
+}
+
+// the last op failed, retry it or what it was part of
+static void config_failed(void)
+{
+	if (wr_state == WR_IDLE)
+		return;
+	wr_left = 0;
+	wr_erase = 0;
+	if (++wr_tries >= CONFIG_TRIES) {
+		wr_broken = 1;
+		wr_state = WR_IDLE;
+		return;
+	}
+	switch (wr_state) {
+	case WR_ERASE:
+		wr_erase = 1;
+		return;
+	case WR_CONFIG:
+	case WR_PROFILE:
+		// give up its place. void the head, so boot passes over it, and
+		// write it again after.
+		if (wr_state == WR_CONFIG)
+			dirty = 1;
+		else
+			dirty_profiles |= 1 << ((wr_rec.head >> REC_ARG_Pos) & 0xF);
+		wr_words(wr_head, &journal_void_word, 1);
+		wr_state = WR_VOID;
+		return;
+	default: // the magic or a void is broken, start over
+		dirty = 1;
+		journal_erase = 1;
+		wr_state = WR_IDLE;
+		return;
+	}
+}
+
+// the last write is done, pick the next one for config_step.
+// returns 0 if everything is in flash, or an erase has to wait.
+static int config_next(const int may_erase)
+{
+	switch (wr_state) {
+	case WR_ERASE: // compact, everything goes in again
+		journal_config = 1;
+		journal_profile = 0;
+		journal_magic = 0;
+		journal_erase = 0;
+		dirty = 1;
+		dirty_profiles = profile_valid;
+		break;
+	case WR_MAGIC:
+		journal_magic = 1;
+		break;
+	case WR_CONFIG:
+	case WR_PROFILE:
+		wr_tries = 0;
+		if (!dirty && dirty_profiles == 0)
+			rescue.magic = 0; // compacted, or nothing to rescue
+		break;
+	}
+	// a word or record, or its void, took its place in the log
+	if (wr_state == WR_CONFIG || wr_state == WR_PROFILE || wr_state == WR_VOID) {
+		if (wr_rec.head >> REC_TAG_Pos == REC_CONFIG)
+			journal_config++;
+		else
+			journal_profile++;
+	}
+	wr_state = WR_IDLE;
+
+	if ((!dirty && dirty_profiles == 0) || wr_broken)
+		return 0;
+	int slot = -1; // the Config first, then the profiles in order
+	if (!dirty)
+		for (slot = 0; (dirty_profiles & (1 << slot)) == 0; slot++)
+			;
+	if (journal_erase || (slot < 0 ? journal_config == JOURNAL_CONFIGS : journal_profile == JOURNAL_PROFILES)) {
+		// only erase now that there is something new to write,
+		// until then the logs stay in place
+		if (!may_erase)
+			return 0;
+		snapshot_make(&rescue.snap);
+		rescue.magic = RESCUE_MAGIC;
+		wr_erase = 1;
+		wr_state = WR_ERASE;
+		return 1;
+	}
+	if (!journal_magic) {
+		wr_words((__IO uint32_t *)&JOURNAL[0], &journal_magic_word, 1);
+		wr_state = WR_MAGIC;
+		return 1;
+	}
+
+	// changes from here on go into the next write
+	if (slot < 0) {
+		dirty = 0;
+		wr_rec.head = rec_word(REC_CONFIG, profile_sel, config_cur);
+		wr_head = (__IO uint32_t *)&JOURNAL[journal_config];
+		wr_words(wr_head, &wr_rec.head, 1);
+		wr_state = WR_CONFIG;
+	} else {
+		dirty_profiles &= ~(1U << slot);
+		wr_rec.head = rec_word(REC_PROFILE, slot, 0);
+		wr_rec.p = profiles[slot];
+		wr_rec.crc = crc32(&wr_rec, offsetof(Profile_record, crc));
+		wr_head = (__IO uint32_t *)&JOURNAL_PROFILE[journal_profile].head;
+		wr_words(wr_head, &wr_rec.head, sizeof(wr_rec) / sizeof(uint32_t));
+		wr_state = WR_PROFILE;
+	}
+	if (rescue.magic == RESCUE_MAGIC)
+		snapshot_make(&rescue.snap);
+	return 1;
+}
+
+// programs one word or erases the sector, and returns as soon as that is
+// started. in ITCM, so the main loop keeps running meanwhile.
+// the rest only runs from flash once the flash is idle.
+__ITCM int config_step(const int may_erase)
+{
+	if ((FLASH->SR & FLASH_SR_BSY) != 0)
+		return 1;
+	FLASH->CR &= ~(FLASH_CR_PG | FLASH_CR_SER | FLASH_CR_SNB);
+	if (flash_errors() != 0)
+		config_failed();
+
+	if (wr_left == 0 && !wr_erase && !config_next(may_erase)) {
+		if ((FLASH->CR & FLASH_CR_LOCK) == 0)
+			flash_lock();
+		return 0;
 	}
-	flash_prog_u16(&CONFIG_SECTOR[config_index], cfg);
-	flash_lock();
+	if ((FLASH->CR & FLASH_CR_LOCK) != 0)
+		flash_unlock();
+
+	if (wr_erase) {
+		wr_erase = 0;
+		// assume voltage range 2.7 - 3.6V for PSIZE (see ref manual pg 71)
+		MODIFY_REG(FLASH->CR,
+				FLASH_CR_PSIZE | FLASH_CR_SNB,
+				_VAL2FLD(FLASH_CR_PSIZE, 0b10) | _VAL2FLD(FLASH_CR_SNB, CONFIG_SECTOR_NUM) | FLASH_CR_SER);
+		FLASH->CR |= FLASH_CR_STRT;
+		trace_ev(TRACE_FLASH, 1, 0);
+	} else {
+		MODIFY_REG(FLASH->CR,
+				FLASH_CR_PSIZE,
+				_VAL2FLD(FLASH_CR_PSIZE, 0b10) | FLASH_CR_PG); // 0b10 for 32-bit
+		*wr_dst++ = *wr_src++;
+		wr_left--;
+		trace_ev(TRACE_FLASH, 0, 0);
+	}
+	__DSB();
+	return 1;
 }
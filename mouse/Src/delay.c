@@ -23,6 +23,7 @@
 
 #include "stm32f7xx.h"
 #include "delay.h"
+#include "itcm.h"
 
 void delay_init(void)
 {
@@ -37,7 +38,7 @@ void delay_init(void)
 }
 
 #ifdef DELAY_SLEEP
-void TIM2_IRQHandler(void)
+__ITCM void TIM2_IRQHandler(void)
 {
 	TIM2->CR1 = 0; // disable counter
 	TIM2->SR = 0; // clear status flag
@@ -32,21 +32,192 @@
 #include "btn_whl.h"
 #include "clock.h"
 #include "config.h"
+#include "cycles.h"
 #include "delay.h"
+#include "handoff.h"
+#include "health.h"
+#include "itcm.h"
+#include "mode.h"
+#include "motion.h"
+#include "report.h"
+#include "trace.h"
+
+// loops between extended motion bursts for Usb_surface, 0 for none.
+// at 8kHz, 64 is 125 samples a second.
+#define SURFACE_EVERY 64
+
+// run one main loop for every usb speed and interval, instead of one loop
+// variant specialised for each. for comparing Usb_stats.loop_cycles.
+//#define LOOP_GENERIC
+
+
+// a setting the control bottom half writes and the main loop copies. the
+// bottom half can preempt the copy, so seq is odd while it writes, and the
+// loop only uses a copy if seq didn't change under it.
+typedef struct {
+	volatile uint32_t seq;
+	uint32_t taken; // seq of the copy the loop uses
+} Pending;
+
+static inline void pending_write_begin(Pending *p)
+{
+	p->seq++;
+	__DMB();
+}
 
-#define TIMEOUT_SECS 5 // seconds of holding buttons for programming mode
+static inline void pending_write_end(Pending *p)
+{
+	__DMB();
+	p->seq++;
+}
 
-typedef union {
-	struct __PACKED { // use the order in the report descriptor
-		uint8_t btn;
-		int8_t whl;
-		int16_t x, y;
-		uint16_t _pad; // zero pad to 8 bytes total
-	};
-	uint8_t u8[8]; // btn, wheel, xlo, xhi, ylo, yhi, 0, 0
-	uint32_t u32[2];
-} Usb_packet;
-static_assert(sizeof(Usb_packet) == 2*sizeof(uint32_t), "Usb_packet wrong size");
+// seq to copy at, 0 if there is nothing new or a write is under way
+static inline uint32_t pending_read_begin(const Pending *p)
+{
+	const uint32_t seq = p->seq;
+	__DMB();
+	return (seq != p->taken && (seq & 1) == 0) ? seq : 0;
+}
+
+// the copy since pending_read_begin() is whole
+static inline int pending_read_end(Pending *p, const uint32_t seq)
+{
+	__DMB();
+	if (p->seq != seq)
+		return 0;
+	p->taken = seq;
+	return 1;
+}
+
+// drop what was written so far, from the bottom half
+static inline void pending_cancel(Pending *p)
+{
+	p->taken = p->seq;
+}
+
+// sent by the host, picked up by the main loop at the start of a microframe
+static Motion_scale scale_pending;
+static Pending scale_seq;
+static Motion_curve curve_pending;
+static Pending curve_seq;
+static Motion_lift lift_pending;
+static Pending lift_seq;
+
+// everything a profile switch does, precomputed
+typedef struct {
+	Paw3399_image img;
+	Motion_scale scale;
+	Motion_curve curve;
+} Profile_rt;
+
+static Profile_rt profile_rt[PROFILE_NUM];
+static uint32_t profile_rt_valid = 0; // bit per slot
+static volatile uint8_t profile_switch = PROFILE_NONE; // slot to switch to
+
+static void profile_compile(const int slot, const Profile *p)
+{
+	Profile_rt *rt = &profile_rt[slot];
+	paw3399_image(&rt->img, p->dpi_x, p->dpi_y, p->angle_snap, p->lod);
+	scale_init(&rt->scale, p->scale_on,
+			p->scale_m[0][0], p->scale_m[0][1], p->scale_m[1][0], p->scale_m[1][1]);
+	curve_init(&rt->curve, p->curve_on, p->curve_shift, p->curve_gain);
+	profile_rt_valid |= 1 << slot;
+}
+
+static int profile_ok(const Profile *p)
+{
+	const uint16_t dpi_max = 0x018F; // 20000dpi, as in mode.c
+	return p->dpi_x <= dpi_max && p->dpi_y <= dpi_max && p->lod <= 2
+			&& p->curve_shift <= CURVE_SHIFT_MAX;
+}
+
+void usb_set_feature(const uint8_t report_id, const uint8_t *buf, const uint32_t len)
+{
+	if (report_id == USB_REPORT_ID_SCALE && len >= sizeof(Usb_scale_report)) {
+		const Usb_scale_report *r = (const Usb_scale_report *)buf;
+		pending_write_begin(&scale_seq);
+		scale_init(&scale_pending, r->on,
+				r->m[0][0], r->m[0][1], r->m[1][0], r->m[1][1]);
+		pending_write_end(&scale_seq);
+	} else if (report_id == USB_REPORT_ID_CURVE && len >= sizeof(Usb_curve_report)) {
+		const Usb_curve_report *r = (const Usb_curve_report *)buf;
+		if (r->shift > CURVE_SHIFT_MAX)
+			return;
+		pending_write_begin(&curve_seq);
+		curve_init(&curve_pending, r->on, r->shift, r->gain);
+		pending_write_end(&curve_seq);
+	} else if (report_id == USB_REPORT_ID_LIFT && len >= sizeof(Usb_lift_report)) {
+		const Usb_lift_report *r = (const Usb_lift_report *)buf;
+		if (r->from < r->below || r->debounce == 0)
+			return;
+		pending_write_begin(&lift_seq);
+		lift_init(&lift_pending, r->on, r->below, r->from, r->debounce);
+		pending_write_end(&lift_seq);
+	} else if (report_id == USB_REPORT_ID_PROFILE && len >= sizeof(Usb_profile_report)) {
+		const Usb_profile_report *r = (const Usb_profile_report *)buf;
+		if (r->slot >= PROFILE_NUM || !profile_ok(&r->p))
+			return;
+		profile_compile(r->slot, &r->p);
+		if (r->save)
+			config_profile_store(r->slot, &r->p);
+	} else if (report_id == USB_REPORT_ID_PROFILE_SEL && len >= sizeof(Usb_profile_sel_report)) {
+		const Usb_profile_sel_report *r = (const Usb_profile_sel_report *)buf;
+		if (r->slot != PROFILE_NONE
+				&& (r->slot >= PROFILE_NUM || (profile_rt_valid & (1 << r->slot)) == 0))
+			return;
+		if (r->slot != PROFILE_NONE) {
+			profile_switch = r->slot;
+			// the profile replaces earlier scale and curve reports
+			pending_cancel(&scale_seq);
+			pending_cancel(&curve_seq);
+		}
+		if (r->save)
+			config_profile_select(r->slot);
+#ifdef TRACE
+	} else if (report_id == USB_REPORT_ID_TRACE && len >= sizeof(Usb_trace_report)) {
+		const Usb_trace_report *r = (const Usb_trace_report *)buf;
+		trace_arm(r->on, r->once);
+#endif
+	}
+}
+
+// instead of a fixed wait for the supply to settle on boot: VDD above the
+// PVD threshold (2.9V) for 1ms without a dip, for at most 25ms
+static int power_settle(void)
+{
+	RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+	PWR->CR1 |= PWR_CR1_PLS | PWR_CR1_PVDE; // PLS = 0b111 for 2.9V
+	const uint32_t start = cycles_now();
+	uint32_t good_from = start;
+	int ok = 0;
+	while (cycles_now() - start < 25000 * CYCLES_PER_US) {
+		if (PWR->CSR1 & PWR_CSR1_PVDO) { // below
+			good_from = cycles_now();
+		} else if (cycles_now() - good_from >= 1000 * CYCLES_PER_US) {
+			ok = 1;
+			break;
+		}
+	}
+	PWR->CR1 &= ~PWR_CR1_PVDE;
+	return ok;
+}
+
+// copy of the bootloader handoff, magic stays 0 if there was none
+// (older bootloader, started from the debugger)
+static Handoff handoff;
+
+// first thing in main, while DWT still counts on the bootloader's clock
+static void handoff_take(void) {
+	const uint32_t now = DWT->CYCCNT;
+	volatile Handoff *h = HANDOFF;
+	if (h->magic != HANDOFF_MAGIC || h->version < 1 || h->size < sizeof(Handoff)
+			|| h->hclk < 1000000) // divided by below
+		return;
+	handoff = *h;
+	h->magic = 0; // stale once read
+	usb_boot.handoff = handoff.reason;
+	usb_boot.loader_us = (now - handoff.entry_cycles) / (handoff.hclk / 1000000);
+}
 
 static Config config_boot(void) {
 	// read button state on boot
@@ -55,7 +226,7 @@ static Config config_boot(void) {
 	btn_boot |= (!(RMB_NO_PORT->IDR & RMB_NO_PIN)) << 1;
 
 	// update config depending on initial buttons
-	delay_ms(25); // delay in case power bounces on boot
+	boot_mark(BOOT_POWER, power_settle()); // in case power bounces on boot
 	Config cfg = config_read();
 	switch (btn_boot) {
 	case 0b01: // LMB pressed
@@ -76,294 +247,419 @@ static Config config_boot(void) {
 		break;
 	}
 
-	// systick is enabled only if RMB was held initially (see bootloader)
-	if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) {
+	// RMB was held initially and released before DFU (see bootloader).
+	// bootloaders without the handoff leave SysTick enabled instead.
+	const int reset = handoff.magic == HANDOFF_MAGIC
+			? handoff.reason == HANDOFF_REASON_RMB
+			: (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) != 0;
+	if (reset) {
 		cfg = config_default;
 		config_write(cfg);
 		anim_diag(1);
 	}
+	config_flush();
+	boot_mark(BOOT_CONFIG, 1);
 	return cfg;
 }
 
-static inline uint32_t mode_process(Config *cfg, int *skip,
-		const uint8_t btn, const uint8_t btn_prev, const uint8_t squal) {
-	// mode 0: normal
-	// mode 1: cpi programming
-	// mode 2: LOD/Hz programming
-	static uint32_t mode = 0;
-	static uint32_t ticks = 0; // counter for programming mode timeout
-	static uint32_t large_step = 0; // ignore releases of the other button for large dpi steps.
-
-	const int hs = ((*cfg & CONFIG_HS_USB) != 0);
-	const int timeout_ticks = TIMEOUT_SECS * (hs ? 8000 : 1000);
-
-	// typically squal in 60s for lifted 3399.
-	const int SQUAL_THRESH = 75;
-	const int lifted = (squal < SQUAL_THRESH);
-
-	const uint16_t dpi_min = 0x0000; // = 0   = 50dpi
-	const uint16_t dpi_max = 0x018F; // = 399 = 20000dpi
-	const uint16_t DPI_LARGE_JUMP = 10; // 10 * 50dpi = 500.
-	uint16_t dpi = _FLD2VAL(CONFIG_DPI, *cfg);
-
-	if (mode == 1) { // handle cpi mode
-		const uint8_t released = (~btn) & btn_prev;
-		if ((released & 0b01) != 0 && !lifted) { // LMB released
-			if (btn & 0b10) { // if RMB is held
-				if (dpi != dpi_min) {
-					dpi = MAX(dpi - DPI_LARGE_JUMP, dpi_min);
-					anim_lg_downup(1);
-				}
-				large_step = 1;
-			} else if (!large_step) {
-				if (dpi != dpi_min) {
-					dpi--;
-					anim_downup(1);
-				}
-			} else {
-				large_step = 0;
-			}
-			*cfg = (*cfg & (~CONFIG_DPI_Msk)) | dpi;
-			paw3399_set_dpi(dpi);
-		}
-		if ((released & 0b10) != 0 && !lifted) { // RMB released
-			if (btn & 0b01) { // if LMB is held
-				if (dpi != dpi_max) {
-					dpi = MIN(dpi + DPI_LARGE_JUMP, dpi_max);
-					anim_lg_updown(1);
-				}
-				large_step = 1;
-			} else if (!large_step) {
-				if (dpi != dpi_max) {
-					dpi++;
-					anim_updown(1);
-				}
-			} else {
-				large_step = 0;
-			}
-			*cfg = (*cfg & (~CONFIG_DPI_Msk)) | dpi;
-			paw3399_set_dpi(dpi);
-		}
-	} else if (mode == 2) { // handle LOD/Hz mode
-		const uint8_t released = (~btn) & btn_prev;
-		if ((released & 0b01) != 0 && !lifted) { // LMB released
-			const int new_lod = (_FLD2VAL(CONFIG_LOD, *cfg) + 1) % 3;
-			*cfg = (*cfg & (~CONFIG_LOD_Msk)) | (new_lod << CONFIG_LOD_Pos);
-			anim_cw(1 + new_lod);
-			paw3399_set_lod(new_lod);
-		}
-		if ((released & 0b10) != 0 && !lifted && hs) { // RMB released in HS mode
-			// loops 8k (0b00) -> 1k (0b11) -> 2k (0b10) -> 4k (0b01) -> 8k
-			const int new_itv = (_FLD2VAL(CONFIG_INTERVAL, *cfg) - 1) % 4;
-			*cfg = (*cfg & (~CONFIG_INTERVAL_Msk)) | (new_itv << CONFIG_INTERVAL_Pos);
-			*skip = (1 << new_itv) - 1;
-			anim_num(1 << (3 - new_itv));
-		}
+__ITCM static void surface_sample(const uint8_t squal, const uint8_t raw_sum,
+		const uint8_t raw_max, const uint8_t raw_min, const uint16_t shutter)
+{
+	Usb_surface *s = &usb_surface;
+	s->squal = squal;
+	s->raw_sum = raw_sum;
+	s->raw_max = raw_max;
+	s->raw_min = raw_min;
+	s->shutter = shutter;
+	s->samples++;
+	s->squal_sum += squal;
+	s->raw_sum_sum += raw_sum;
+	s->raw_max_sum += raw_max;
+	s->raw_min_sum += raw_min;
+	s->shutter_sum += shutter;
+}
+
+// state of the main loop, carried across the loop variants
+typedef struct {
+	Config cfg;
+	int hs; // only for LOOP_GENERIC
+	int skip; // reports to skip after each sent one, from the interval
+	int count; // counter to skip reports
+	uint8_t btn_prev;
+	Whl_state whl;
+	Usb_packet new; // what's new this loop
+	Usb_packet send; // what's transmitted
+	Motion_acc acc; // what's not yet transmitted
+	Motion_scale scale; // off until the host sets it
+	Motion_curve curve; // same
+	Motion_lift lift;
+	int surface_count; // loops to the next extended burst
+	Mode mode;
+	uint32_t fifo_space; // fifo space when empty
+	uint32_t fn_last; // frame number of the last SOF, 14 bits. in HS this counts microframes
+	int slot_i;
+	uint8_t profile; // last switched to, PROFILE_NONE if none
+	Sensor_health health;
+} Loop;
+
+#ifdef USB_DMA
+// read by the OTG DMA. RAM is all DTCM, which isn't cached, so no
+// clean is needed. two slots so the next report never overwrites one the
+// DMA may still be fetching.
+static Usb_packet slot[2];
+#endif
+
+// returns 0 when the loop variant no longer matches the interval
+static inline __attribute__((always_inline)) int loop_end(const Loop *l,
+		const uint32_t loop_start, const int skip)
+{
+	const uint32_t cycles = cycles_now() - loop_start;
+	trace_ev(TRACE_LOOP_END, 0, 0);
+	usb_stats.loops++;
+	usb_stats.loop_cycles += cycles;
+	usb_stats.loop_max = MAX(usb_stats.loop_max, cycles);
+	return l->skip == skip;
+}
+
+// one microframe. hs_usb and skip are constants in each loop variant below,
+// so the tests on them and the skip bookkeeping fold away where unused.
+static inline __attribute__((always_inline)) int loop_once(Loop *l,
+		const int hs_usb, const int skip)
+{
+	const uint32_t USBx_BASE = (uint32_t) USB_OTG_HS; // used in macros USBx_*
+	const uint32_t fn_max = USB_OTG_DSTS_FNSOF_Msk >> USB_OTG_DSTS_FNSOF_Pos;
+	// masks PendSV and EP1 IN, see usb.h
+	const uint32_t basepri_report = USB_PRIO_EP1 << (8U - __NVIC_PRIO_BITS);
+
+	// queued flash writes, at most one word per loop. PendSV is still masked here.
+	const int flash_busy = config_step(usb_ctrl_idle());
+
+	// let the control bottom half run, the last report is committed.
+	// it runs from flash and would stall the loop while the flash is busy,
+	// so it waits for that, unless usb is not configured and needs it.
+	const int configured = (USBD_Device.dev_state == USBD_STATE_CONFIGURED);
+	__set_BASEPRI((flash_busy && configured) ? basepri_report : 0);
+
+	// always check that usb is configured
+	const int waited = !configured;
+	usb_wait_configured();
+
+	// wait for SOF to sync to usb frames. write, don't OR: the other
+	// GINTSTS flags are also write-1-to-clear and may be waiting for PendSV
+	USB_OTG_HS->GINTSTS = USB_OTG_GINTSTS_SOF;
+	__WFI();
+
+	// hold off the control bottom half and EP1 until the report is in the fifo
+	__set_BASEPRI(basepri_report);
+	const uint32_t loop_start = cycles_now();
+	if (!waited) {
+		const uint32_t wake = loop_start - usb_sof_at;
+		usb_stats.wake_cycles += wake;
+		usb_stats.wake_max = MAX(usb_stats.wake_max, wake);
+		if (flash_busy)
+			usb_stats.wake_max_flash = MAX(usb_stats.wake_max_flash, wake);
 	}
 
-	if (mode == 0) {
-		if (lifted && btn == 0b011) {
-			ticks++;
-			if (ticks == timeout_ticks) {
-				// show DPI
-				// 10k steps (50 * 200)
-                anim_updown_pause((dpi + 1) / 200);
-                // 1k steps (50 * 20)
-                anim_rightleft_pause(((dpi + 1) % 200) / 20);
-                // 100 steps (50 * 2)
-                anim_downup_pause((((dpi + 1) % 200) % 20) / 2);
-                // 50 steps (50 * 1)
-                anim_leftright_pause((((dpi + 1) % 200) % 20) % 2);
-			}
-			if (ticks == 2*timeout_ticks) {
-				anim_cw(1 + _FLD2VAL(CONFIG_LOD, *cfg));
-				if (hs) {
-					anim_pause(500);
-					anim_num(1 << (3 - _FLD2VAL(CONFIG_INTERVAL, *cfg)));
-				}
-			}
-		} else if (ticks < timeout_ticks) {
-			ticks = 0;
-		} // else, ticks >= timeout_ticks, save the value and wait
-
-		if (btn == 0 && ticks >= timeout_ticks) {
-			if (ticks >= 2*timeout_ticks) {
-				mode = 2;
-			} else { // timeout_ticks <= times <= 2*timeout_ticks
-				mode = 1;
-			}
-		}
-	} else { // mode == 1 || mode == 2
-		if (lifted && btn == 0b011) {
-			ticks++;
-			if (ticks == timeout_ticks) {
-				if (mode == 1) {
-					// show DPI
-					// 10k steps (50 * 200)
-                    anim_updown_pause((dpi + 1) / 200);
-                    // 1k steps (50 * 20)
-                    anim_rightleft_pause(((dpi + 1) % 200) / 20);
-                    // 100 steps (50 * 2)
-                    anim_downup_pause((((dpi + 1) % 200) % 20) / 2);
-                    // 50 steps (50 * 1)
-                    anim_leftright_pause((((dpi + 1) % 200) % 20) % 2);
-				} else if (mode == 2) {
-					anim_cw(1 + _FLD2VAL(CONFIG_LOD, *cfg));
-					if (hs) {
-						anim_pause(500);
-						anim_num(1 << (3 - _FLD2VAL(CONFIG_INTERVAL, *cfg)));
-					}
-				}
-				mode = 0;
-				config_write(*cfg);
-				ticks = 0;
-			}
-		} else {
-			ticks = 0;
+	// count SOFs the loop was too slow to see. frame numbers jump over suspend.
+	const uint32_t fn = _FLD2VAL(USB_OTG_DSTS_FNSOF, USBx_DEVICE->DSTS);
+	const uint32_t fn_gap = (fn - l->fn_last) & fn_max;
+	if (fn_gap > 1 && !waited)
+		usb_stats.sof_missed += fn_gap - 1;
+	l->fn_last = fn;
+	trace_ev(TRACE_SOF, 0, fn);
+
+	// if full speed usb, delay here to minimize input lag
+	if (!hs_usb)
+		delay_us(873);
+
+	// switch profiles in the wait before the sensor read. not while the
+	// flash is busy, the struct copies may call memcpy from flash. a
+	// word started by config_step is long done by now.
+	const int flash_idle = ((FLASH->SR & FLASH_SR_BSY) == 0);
+	uint32_t wait_us = 88;
+	const uint8_t sw = profile_switch;
+	if (sw != PROFILE_NONE && flash_idle && !l->health.down) {
+		const uint32_t start = cycles_now();
+		paw3399_apply(&profile_rt[sw].img);
+		l->scale = profile_rt[sw].scale;
+		l->curve = profile_rt[sw].curve;
+		l->profile = sw;
+		profile_switch = PROFILE_NONE;
+		const uint32_t used = (cycles_now() - start) / CYCLES_PER_US;
+		wait_us = (used < wait_us) ? wait_us - used : 0;
+	}
+	if (wait_us > 0)
+		delay_us(wait_us);
+
+	// read sensor, buttons. not while the sensor is re-initialised,
+	// reports go on with zero motion then.
+	uint8_t squal = 0;
+	if (!l->health.down) {
+		trace_ev(TRACE_BURST_BEGIN, 0, 0);
+		ss_low();
+		spi_send(0x16);
+		delay_us(2);
+		(void) spi_recv(); // motion, not used
+		(void) spi_recv(); // observation, not used
+		l->new.u8[2] = spi_recv(); // x lower 8 bits
+		l->new.u8[3] = spi_recv(); // x upper 8 bits
+		l->new.u8[4] = spi_recv(); // y lower 8 bits
+		l->new.u8[5] = spi_recv(); // y upper 8 bits
+		squal = spi_recv(); // SQUAL
+		if (SURFACE_EVERY > 0 && --l->surface_count <= 0) {
+			// carry on with the rest of the burst
+			l->surface_count = SURFACE_EVERY;
+			const uint8_t raw_sum = spi_recv(); // RawData_Sum
+			const uint8_t raw_max = spi_recv(); // Maximum_RawData
+			const uint8_t raw_min = spi_recv(); // Minimum_RawData
+			const uint8_t shutter_hi = spi_recv(); // Shutter_Upper
+			const uint8_t shutter_lo = spi_recv(); // Shutter_Lower
+			if (!l->lift.lifted)
+				surface_sample(squal, raw_sum, raw_max, raw_min, (shutter_hi << 8) | shutter_lo);
 		}
+		ss_high();
+		trace_ev(TRACE_BURST_END, squal, 0);
+	} else {
+		l->new.x = l->new.y = 0;
+	}
+
+	// drop motion while lifted, before it reaches the backlog
+	const uint32_t lift_at = pending_read_begin(&lift_seq);
+	if (lift_at != 0) {
+		const Motion_lift p = lift_pending;
+		if (pending_read_end(&lift_seq, lift_at))
+			lift_init(&l->lift, p.on, p.below, p.from, p.debounce);
+	}
+	// no squal while the sensor is down, the lift state holds then
+	if (!l->health.down && lift_update(&l->lift, squal) && l->lift.lifted)
+		usb_stats.lifts++;
+	int lift_zeroed = 0;
+	if (l->lift.on && l->lift.lifted && (l->new.x | l->new.y) != 0) {
+		l->new.x = l->new.y = 0;
+		lift_zeroed = 1;
+		usb_stats.lift_zeroed++;
+	}
+
+	l->new.whl = whl_due(&l->whl, hs_usb) ? whl_decode(&l->whl, whl_read()) : 0;
+	if (l->new.whl != 0)
+		trace_ev(TRACE_WHL, l->new.whl, 0);
+
+	l->btn_prev = l->new.btn;
+	l->new.btn = btn_latch(btn_read(), l->btn_prev);
+	if (l->new.btn != l->btn_prev)
+		trace_ev(TRACE_BTN, l->new.btn, 0);
+
+	// mode processing, only on input changes and deadlines. it runs from
+	// flash, so not while config_step has it busy. the mode clock stands still then.
+	if (flash_idle && mode_changed(&l->mode, l->new.btn, l->lift.lifted)) {
+		const uint32_t fx = mode_event(&l->mode, &l->cfg);
+		if (fx & MODE_FX_DPI)
+			paw3399_set_dpi(_FLD2VAL(CONFIG_DPI, l->cfg));
+		if (fx & MODE_FX_LOD)
+			paw3399_set_lod(_FLD2VAL(CONFIG_LOD, l->cfg));
+		if (fx & MODE_FX_ITV)
+			l->skip = (1 << _FLD2VAL(CONFIG_INTERVAL, l->cfg)) - 1;
+		if (fx & MODE_FX_SAVE)
+			config_write(l->cfg);
+	}
+	const uint32_t mask = l->mode.mask;
+
+	// fractional cpi / rotation, then response curve
+	int32_t dx = l->new.x, dy = l->new.y;
+	const uint32_t scale_at = pending_read_begin(&scale_seq);
+	if (scale_at != 0) {
+		const Motion_scale s = scale_pending;
+		if (pending_read_end(&scale_seq, scale_at))
+			l->scale = s;
+	}
+	// not while the flash is busy, the copy may call memcpy
+	const uint32_t curve_at = flash_idle ? pending_read_begin(&curve_seq) : 0;
+	if (curve_at != 0) {
+		const Motion_curve c = curve_pending;
+		if (pending_read_end(&curve_seq, curve_at))
+			l->curve = c;
+	}
+	if (l->scale.on)
+		scale_apply(&l->scale, PACK16(l->new.x, l->new.y), &dx, &dy);
+	if (l->curve.on)
+		curve_apply(&l->curve, hs_usb ? CURVE_PER_MS_HS : CURVE_PER_MS_FS, &dx, &dy);
+
+	// animation stuff
+	const struct Xy a = anim_read(); // returns 0 if no animation left
+	acc_add(&l->acc, dx + a.x, dy + a.y, l->new.whl);
+
+	// if last packet still sitting in fifo
+	int resend = 0;
+	if ((USBx_INEP(1)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) < l->fifo_space) {
+		// flush fifo
+		USB_OTG_HS->GRSTCTL = _VAL2FLD(USB_OTG_GRSTCTL_TXFNUM,
+				1) | USB_OTG_GRSTCTL_TXFFLSH;
+		while ((USB_OTG_HS->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH) != 0)
+			;
+		l->count = 0; // reset counter, try to transmit again
+		// the host never saw it, so it goes back into the backlog
+		report_requeue(&l->acc, &l->send);
+		resend = 1; // also if it only carried a button change
+		usb_stats.flushed++;
+		trace_ev(TRACE_FLUSH, 0, 0);
+	}
+
+	// skip transmission for "skip" loops after a successful transmission,
+	// then transmit if there is data
+	const int next = report_next(&l->count, skip, &l->send, &l->acc, l->new.btn, resend);
+	if (next == REPORT_SKIP || next == REPORT_HELD) {
+		if (next == REPORT_HELD)
+			usb_stats.skipped++;
+		return loop_end(l, loop_start, skip);
+	}
+
+	if (next == REPORT_SEND) {
+		const uint32_t commit_start = cycles_now();
+		trace_ev(TRACE_COMMIT_BEGIN, 0, 0);
+#ifdef USB_DMA
+		Usb_packet *const p = &slot[l->slot_i];
+		l->slot_i ^= 1;
+		p->u32[0] = l->send.u32[0] & mask;
+		p->u32[1] = l->send.u32[1];
+#endif
+		// set up transfer size
+		MODIFY_REG(USBx_INEP(1)->DIEPTSIZ,
+				USB_OTG_DIEPTSIZ_PKTCNT | USB_OTG_DIEPTSIZ_XFRSIZ,
+				_VAL2FLD(USB_OTG_DIEPTSIZ_PKTCNT, 1) | _VAL2FLD(USB_OTG_DIEPTSIZ_XFRSIZ, HID_EPIN_SIZE));
+#ifdef USB_DMA
+		// the core fetches the report into the fifo itself once enabled
+		USBx_INEP(1)->DIEPDMA = (uint32_t)p;
+#endif
+		// enable endpoint
+		USBx_INEP(1)->DIEPCTL |= USB_OTG_DIEPCTL_CNAK
+				| USB_OTG_DIEPCTL_EPENA;
+#ifndef USB_DMA
+		// write to fifo
+		USBx_DFIFO(1) = l->send.u32[0] & mask;
+		USBx_DFIFO(1) = l->send.u32[1];
+#endif
+		usb_commit_at = cycles_now();
+		trace_ev(TRACE_COMMIT_END, 0, 0);
+		usb_stats.commit_cycles += usb_commit_at - commit_start;
+		usb_stats.sent++;
+		if (usb_stats.sent == 1)
+			boot_mark(BOOT_REPORT, 1);
+	} else if (lift_zeroed) {
+		usb_stats.lift_saved++;
 	}
 
-	// input mask
-	return (mode == 0) ? 0xFFFFFFFF : 0xFFFFFFFC;
+	// sensor health, in the idle time after the commit
+	health_loop(&l->health, l->cfg,
+			(l->profile != PROFILE_NONE) ? &profile_rt[l->profile].img : NULL, flash_idle);
+	return loop_end(l, loop_start, skip);
 }
 
-int main(void) {
-//	extern uint32_t _sitcm;
-//	SCB->VTOR = (uint32_t)(&_sitcm);
-	extern uint32_t _sflash;
-	SCB->VTOR = (uint32_t) (&_sflash);
+// the loop state stays in main's Loop, it is too large for registers.
+// Usb_stats.loop tells which one runs, compare loop_cycles against
+// LOOP_GENERIC. loop_max starts over with each variant, so it is that
+// variant's worst case.
+#define LOOP_VARIANT(name, hs, skip) \
+	__ITCM __attribute__((noinline)) static void name(Loop *l) \
+	{ \
+		usb_stats.loop = ((hs) ? USB_LOOP_HS : 0) | (skip); \
+		usb_stats.loop_max = 0; \
+		while (loop_once(l, (hs), (skip))) \
+			; \
+	}
+
+#ifdef LOOP_GENERIC
+__ITCM __attribute__((noinline)) static void loop_generic(Loop *l)
+{
+	usb_stats.loop = USB_LOOP_GENERIC | (l->hs ? USB_LOOP_HS : 0) | l->skip;
+	usb_stats.loop_max = 0;
+	while (loop_once(l, l->hs, l->skip))
+		;
+}
+#else
+LOOP_VARIANT(loop_fs, 0, 0) // full speed runs at 1kHz only
+LOOP_VARIANT(loop_hs_8k, 1, 0)
+LOOP_VARIANT(loop_hs_4k, 1, 1)
+LOOP_VARIANT(loop_hs_2k, 1, 3)
+LOOP_VARIANT(loop_hs_1k, 1, 7)
+
+// by CONFIG_INTERVAL
+static void (*const loop_hs[4])(Loop *l) = {loop_hs_8k, loop_hs_4k, loop_hs_2k, loop_hs_1k};
+#endif
+
+__ITCM int main(void) {
+	handoff_take();
+
+	// copy the vector table to ITCM, so interrupt entry doesn't read flash
+	extern uint32_t _sflash, _sitcm, _isr_vector_size;
+	const uint32_t *vec_flash = &_sflash;
+	uint32_t *vec_itcm = &_sitcm;
+	for (uint32_t i = 0; i < (uint32_t)(&_isr_vector_size) / sizeof(uint32_t); i++)
+		vec_itcm[i] = vec_flash[i];
+	__DSB();
+	SCB->VTOR = (uint32_t) (&_sitcm);
+	__DSB();
 	SCB_EnableICache();
 	SCB_EnableDCache();
 
 	clk_init();
 	delay_init();
+	cycles_init();
 	btn_whl_init();
-	uint8_t btn_prev = 0;
-	int whl_lastlast = whl_read();
-	int whl_last = whl_lastlast;
-	int whl_count = 0; // microframe counter for limiting wheel code rate
 	Config cfg = config_boot();
 
 	const int hs_usb = ((cfg & CONFIG_HS_USB) != 0);
 	anim_set_scale(hs_usb ? 8 : 1);
 	usb_init(hs_usb);
 	usb_wait_configured();
+	boot_mark(BOOT_USB_CONFIGURED, 1);
 
 	spi_init();
-	paw3399_init(cfg);
+	boot_mark(BOOT_SENSOR, paw3399_init(cfg));
+	for (int i = 0; i < PROFILE_NUM; i++) {
+		const Profile *p = config_profile(i);
+		if (p != NULL && profile_ok(p))
+			profile_compile(i, p);
+	}
+	// applied by the first loop
+	const uint8_t sel = config_profile_selected();
+	if (sel != PROFILE_NONE && (profile_rt_valid & (1 << sel)) != 0)
+		profile_switch = sel;
 
 	const uint32_t USBx_BASE = (uint32_t) USB_OTG_HS; // used in macros USBx_*
-	// fifo space when empty, should equal 0x174, from init_usb
-	const uint32_t fifo_space = (USBx_INEP(1)->DTXFSTS
-			& USB_OTG_DTXFSTS_INEPTFSAV);
-
-	Usb_packet new = { 0 }; // what's new this loop
-	Usb_packet send = { 0 }; // what's transmitted
-
-	int skip = hs_usb ? (1 << _FLD2VAL(CONFIG_INTERVAL, cfg)) - 1 : 0;
-	int count = 0; // counter to skip reports
-
+	Loop l = {
+		.cfg = cfg,
+		.hs = hs_usb,
+		.skip = hs_usb ? (1 << _FLD2VAL(CONFIG_INTERVAL, cfg)) - 1 : 0,
+		.whl = {.lastlast = whl_read()},
+		// fifo space when empty, should equal 0x174, from init_usb
+		.fifo_space = (USBx_INEP(1)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV),
+		.fn_last = _FLD2VAL(USB_OTG_DSTS_FNSOF, USBx_DEVICE->DSTS),
+	};
+	l.whl.last = l.whl.lastlast;
+	mode_init(&l.mode, hs_usb);
+	// 1ms at 8kHz
+	lift_init(&l.lift, 1, LIFT_SQUAL_BELOW, LIFT_SQUAL_FROM, hs_usb ? 8 : 1);
+	l.profile = PROFILE_NONE;
+	health_init(&l.health);
+
+	// GINTMSK is also written by the usb interrupts
+	__disable_irq();
 	USB_OTG_HS->GINTMSK |= USB_OTG_GINTMSK_SOFM; // enable SOF interrupt
+	__enable_irq();
+	// masks PendSV and EP1 IN, see usb.h
+	const uint32_t basepri_report = USB_PRIO_EP1 << (8U - __NVIC_PRIO_BITS);
+	__set_BASEPRI(basepri_report);
+	boot_mark(BOOT_LOOP, 1);
 	while (1) {
-		// always check that usb is configured
-		usb_wait_configured();
-
-		// wait for SOF to sync to usb frames
-		USB_OTG_HS->GINTSTS |= USB_OTG_GINTSTS_SOF;
-		__WFI();
-
-		// if full speed usb, delay here to minimize input lag
+#ifdef LOOP_GENERIC
+		loop_generic(&l);
+#else
+		// back here when the report interval changes
 		if (!hs_usb)
-			delay_us(873);
-
-		delay_us(88);
-
-		// read sensor, buttons
-		ss_low();
-		spi_send(0x16);
-		delay_us(2);
-		(void) spi_recv(); // motion, not used
-		(void) spi_recv(); // observation, not used
-		new.u8[2] = spi_recv(); // x lower 8 bits
-		new.u8[3] = spi_recv(); // x upper 8 bits
-		new.u8[4] = spi_recv(); // y lower 8 bits
-		new.u8[5] = spi_recv(); // y upper 8 bits
-		const uint8_t squal = spi_recv(); // SQUAL
-		ss_high();
-
-		new.whl = 0;
-
-		if (whl_count == 0) {
-			const int whl_now = whl_read();
-			if (whl_now != whl_last) {
-				if (!((whl_now == 0 && whl_last == 3) || (whl_now == 3 && whl_last == 0))) {
-					if (whl_now == 0 && whl_lastlast == 3) {
-						new.whl = (whl_last == 1) ? -1 : (whl_last == 2) ? 1 : 0;
-					} else if (whl_now == 3 && whl_lastlast == 0) {
-						new.whl = (whl_last == 1) ? 1 : (whl_last == 2) ? -1 : 0;
-					}
-					whl_lastlast = whl_last;
-					whl_last = whl_now;
-				}
-			}
-		}
-		if (hs_usb) // only run wheel code every 4 microframes
-			whl_count = (whl_count + 1) % 4;
-
-		const uint16_t btn_raw = btn_read();
-		const uint8_t btn_NO = (btn_raw & 0xFF);
-		const uint8_t btn_NC = (btn_raw >> 8);
-		btn_prev = new.btn;
-		new.btn = (~btn_NO & 0b111) | (btn_NC & btn_prev);
-
-		// mode processing
-		const uint32_t mask = mode_process(&cfg, &skip, new.btn, btn_prev, squal);
-
-		// animation stuff
-		const struct Xy a = anim_read(); // returns 0 if no animation left
-		new.x += a.x;
-		new.y += a.y;
-
-		// if last packet still sitting in fifo
-		if ((USBx_INEP(1)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) < fifo_space) {
-			// flush fifo
-			USB_OTG_HS->GRSTCTL = _VAL2FLD(USB_OTG_GRSTCTL_TXFNUM,
-					1) | USB_OTG_GRSTCTL_TXFFLSH;
-			while ((USB_OTG_HS->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH) != 0)
-				;
-			count = 0; // reset counter, try to transmit again
-		} else if (count == skip) { // last loop transmitted successfully
-			send.whl = 0;
-			send.x = 0;
-			send.y = 0;
-		}
-		send.whl += new.whl;
-		send.x += new.x;
-		send.y += new.y;
-
-		// skip transmission for "skip" loops after a successful transmission
-		if (count > 0) {
-			count--;
-			continue;
-		}
-
-		// if there is data to transmitted
-		if (new.btn != send.btn || send.whl || send.x || send.y) {
-			send.btn = new.btn;
-			// disable transfer complete interrupts, in case enabled by OTG_HS_IRQHandler
-			USBx_DEVICE->DIEPMSK &= ~USB_OTG_DIEPMSK_XFRCM;
-			// set up transfer size
-			MODIFY_REG(USBx_INEP(1)->DIEPTSIZ,
-					USB_OTG_DIEPTSIZ_PKTCNT | USB_OTG_DIEPTSIZ_XFRSIZ,
-					_VAL2FLD(USB_OTG_DIEPTSIZ_PKTCNT, 1) | _VAL2FLD(USB_OTG_DIEPTSIZ_XFRSIZ, HID_EPIN_SIZE));
-			// enable endpoint
-			USBx_INEP(1)->DIEPCTL |= USB_OTG_DIEPCTL_CNAK
-					| USB_OTG_DIEPCTL_EPENA;
-			// write to fifo
-			USBx_DFIFO(1) = send.u32[0] & mask;
-			USBx_DFIFO(1) = send.u32[1];
-			count = skip;
-		}
+			loop_fs(&l);
+		else
+			loop_hs[_FLD2VAL(CONFIG_INTERVAL, l.cfg)](&l);
+#endif
 	}
 	return 0;
 }
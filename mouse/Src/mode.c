@@ -0,0 +1,259 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mode.h"
+#include "anim.h"
+
+// as in core_cm7.h, which needs the device header
+#ifndef _FLD2VAL
+#define _FLD2VAL(field, value) (((uint32_t)(value) & field ## _Msk) >> field ## _Pos)
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// events, handled in this order within one microframe
+enum {
+	EV_LMB_UP, // released while not lifted
+	EV_RMB_UP,
+	EV_COMBO_OFF,
+	EV_COMBO_ON, // LMB+RMB only, lifted
+	EV_TIMEOUT,
+	EV_ALL_UP, // all buttons released
+	EV_NUM
+};
+
+enum {
+	ACT_NONE,
+	ACT_ARM, // start counting to the timeout
+	ACT_DISARM,
+	ACT_PAUSE,
+	ACT_RESUME,
+	ACT_SHOW_DPI, // and count on to the second timeout
+	ACT_SHOW_LODHZ,
+	ACT_SAVE_DPI, // show, save and leave
+	ACT_SAVE_LODHZ,
+	ACT_DPI_DOWN,
+	ACT_DPI_UP,
+	ACT_LOD_NEXT,
+	ACT_ITV_NEXT,
+};
+
+typedef struct {
+	uint8_t next; // Mode_state
+	uint8_t act;
+} Mode_transition;
+
+#define T(s, a) {MODE_##s, ACT_##a}
+#define KEEP {0xFF, ACT_NONE}
+
+// KEEP leaves the state alone. every row lists all events,
+// a zero entry would be a move to MODE_NORMAL.
+static const Mode_transition table[MODE_STATE_NUM][EV_NUM] = {
+	[MODE_NORMAL] = {
+		KEEP, KEEP, KEEP, T(HOLD1, ARM), KEEP, KEEP},
+	[MODE_HOLD1] = {
+		KEEP, KEEP, T(NORMAL, DISARM), KEEP, T(ARMED1_HOLD, SHOW_DPI), KEEP},
+	[MODE_ARMED1_HOLD] = {
+		KEEP, KEEP, T(ARMED1, PAUSE), KEEP, T(ARMED2, SHOW_LODHZ), KEEP},
+	[MODE_ARMED1] = {
+		KEEP, KEEP, KEEP, T(ARMED1_HOLD, RESUME), KEEP, T(DPI, NONE)},
+	[MODE_ARMED2] = {
+		KEEP, KEEP, KEEP, KEEP, KEEP, T(LODHZ, NONE)},
+	[MODE_DPI] = {
+		T(DPI, DPI_DOWN), T(DPI, DPI_UP), KEEP, T(DPI_HOLD, ARM), KEEP, KEEP},
+	[MODE_DPI_HOLD] = {
+		T(DPI_HOLD, DPI_DOWN), T(DPI_HOLD, DPI_UP), T(DPI, DISARM), KEEP, T(NORMAL, SAVE_DPI), KEEP},
+	[MODE_LODHZ] = {
+		T(LODHZ, LOD_NEXT), T(LODHZ, ITV_NEXT), KEEP, T(LODHZ_HOLD, ARM), KEEP, KEEP},
+	[MODE_LODHZ_HOLD] = {
+		T(LODHZ_HOLD, LOD_NEXT), T(LODHZ_HOLD, ITV_NEXT), T(LODHZ, DISARM), KEEP, T(NORMAL, SAVE_LODHZ), KEEP},
+};
+
+static const uint16_t dpi_min = 0x0000; // = 0   = 50dpi
+static const uint16_t dpi_max = 0x018F; // = 399 = 20000dpi
+#define DPI_LARGE_JUMP 10 // 10 * 50dpi = 500.
+
+void mode_init(Mode *m, const int hs)
+{
+	*m = (Mode){
+		.state = MODE_NORMAL,
+		.hs = hs,
+		.now = 1,
+		.deadline = MODE_NEVER,
+		.timeout_ticks = TIMEOUT_SECS * (hs ? 8000 : 1000),
+		.mask = 0xFFFFFFFF,
+	};
+}
+
+static void anim_dpi(const uint16_t dpi)
+{
+	// 10k steps (50 * 200)
+	anim_updown_pause((dpi + 1) / 200);
+	// 1k steps (50 * 20)
+	anim_rightleft_pause(((dpi + 1) % 200) / 20);
+	// 100 steps (50 * 2)
+	anim_downup_pause((((dpi + 1) % 200) % 20) / 2);
+	// 50 steps (50 * 1)
+	anim_leftright_pause((((dpi + 1) % 200) % 20) % 2);
+}
+
+static void anim_lodhz(const Config cfg, const int hs)
+{
+	anim_cw(1 + _FLD2VAL(CONFIG_LOD, cfg));
+	if (hs) {
+		anim_pause(500);
+		anim_num(1 << (3 - _FLD2VAL(CONFIG_INTERVAL, cfg)));
+	}
+}
+
+// step dpi by one, or by DPI_LARGE_JUMP with the other button held
+static uint32_t dpi_step(Mode *m, Config *cfg, const int up, const uint8_t other)
+{
+	uint16_t dpi = _FLD2VAL(CONFIG_DPI, *cfg);
+	if (m->in & other) {
+		if (up && dpi != dpi_max) {
+			dpi = MIN(dpi + DPI_LARGE_JUMP, dpi_max);
+			anim_lg_updown(1);
+		} else if (!up && dpi != dpi_min) {
+			dpi = MAX(dpi - DPI_LARGE_JUMP, dpi_min);
+			anim_lg_downup(1);
+		}
+		m->large_step = 1;
+	} else if (!m->large_step) {
+		if (up && dpi != dpi_max) {
+			dpi++;
+			anim_updown(1);
+		} else if (!up && dpi != dpi_min) {
+			dpi--;
+			anim_downup(1);
+		}
+	} else {
+		m->large_step = 0;
+	}
+	*cfg = (*cfg & (~CONFIG_DPI_Msk)) | dpi;
+	return MODE_FX_DPI;
+}
+
+// ticks from now. now wraps after days, the deadline must not land on MODE_NEVER then.
+static uint32_t deadline_in(const Mode *m, const uint32_t ticks)
+{
+	const uint32_t d = m->now + ticks;
+	return (d == MODE_NEVER) ? d + 1 : d;
+}
+
+static uint32_t act(Mode *m, Config *cfg, const int a)
+{
+	switch (a) {
+	case ACT_ARM:
+		m->deadline = deadline_in(m, m->timeout_ticks);
+		break;
+	case ACT_DISARM:
+		m->deadline = MODE_NEVER;
+		break;
+	case ACT_PAUSE:
+		m->left = m->deadline - m->now;
+		m->deadline = MODE_NEVER;
+		break;
+	case ACT_RESUME:
+		m->deadline = deadline_in(m, m->left);
+		break;
+	case ACT_SHOW_DPI:
+		anim_dpi(_FLD2VAL(CONFIG_DPI, *cfg));
+		m->deadline = deadline_in(m, m->timeout_ticks);
+		break;
+	case ACT_SHOW_LODHZ:
+		anim_lodhz(*cfg, m->hs);
+		m->deadline = MODE_NEVER;
+		break;
+	case ACT_SAVE_DPI:
+		anim_dpi(_FLD2VAL(CONFIG_DPI, *cfg));
+		m->deadline = MODE_NEVER;
+		return MODE_FX_SAVE;
+	case ACT_SAVE_LODHZ:
+		anim_lodhz(*cfg, m->hs);
+		m->deadline = MODE_NEVER;
+		return MODE_FX_SAVE;
+	case ACT_DPI_DOWN:
+		return dpi_step(m, cfg, 0, 0b10);
+	case ACT_DPI_UP:
+		return dpi_step(m, cfg, 1, 0b01);
+	case ACT_LOD_NEXT: {
+		const int new_lod = (_FLD2VAL(CONFIG_LOD, *cfg) + 1) % 3;
+		*cfg = (*cfg & (~CONFIG_LOD_Msk)) | (new_lod << CONFIG_LOD_Pos);
+		anim_cw(1 + new_lod);
+		return MODE_FX_LOD;
+	}
+	case ACT_ITV_NEXT:
+		if (!m->hs) // full speed usb runs at 1kHz only
+			break;
+		// loops 8k (0b00) -> 1k (0b11) -> 2k (0b10) -> 4k (0b01) -> 8k
+		const int new_itv = (_FLD2VAL(CONFIG_INTERVAL, *cfg) - 1) % 4;
+		*cfg = (*cfg & (~CONFIG_INTERVAL_Msk)) | (new_itv << CONFIG_INTERVAL_Pos);
+		anim_num(1 << (3 - new_itv));
+		return MODE_FX_ITV;
+	}
+	return 0;
+}
+
+static uint32_t dispatch(Mode *m, Config *cfg, const int ev)
+{
+	const Mode_transition *t = &table[m->state][ev];
+	if (t->next == 0xFF)
+		return 0;
+	m->state = t->next;
+	return act(m, cfg, t->act);
+}
+
+// in flash like the table, the animations and config_write, so the main loop
+// only calls it while the flash is idle
+uint32_t mode_event(Mode *m, Config *cfg)
+{
+	const uint8_t btn = m->in & 0b111;
+	const uint8_t btn_prev = m->in_prev & 0b111;
+	const int lifted = (m->in & MODE_IN_LIFTED) != 0;
+	const int combo = lifted && btn == 0b011;
+	const int combo_prev = (m->in_prev & MODE_IN_LIFTED) && btn_prev == 0b011;
+	const uint8_t released = (~btn) & btn_prev;
+
+	uint32_t fx = 0;
+	if ((released & 0b01) && !lifted)
+		fx |= dispatch(m, cfg, EV_LMB_UP);
+	if ((released & 0b10) && !lifted)
+		fx |= dispatch(m, cfg, EV_RMB_UP);
+	if (combo_prev && !combo)
+		fx |= dispatch(m, cfg, EV_COMBO_OFF);
+	if (combo && !combo_prev)
+		fx |= dispatch(m, cfg, EV_COMBO_ON);
+	if (m->deadline != MODE_NEVER && m->now == m->deadline)
+		fx |= dispatch(m, cfg, EV_TIMEOUT);
+	if (btn == 0 && btn_prev != 0)
+		fx |= dispatch(m, cfg, EV_ALL_UP);
+
+	// programming modes keep LMB and RMB from the host
+	m->mask = (m->state <= MODE_ARMED2) ? 0xFFFFFFFF : 0xFFFFFFFC;
+	return fx;
+}
@@ -27,10 +27,33 @@
 #include "usbd_desc.h"
 #include "usbd_hid.h"
 #include "stm32f7xx_hal.h"
+#include "itcm.h"
+#include "cycles.h"
+#include "trace.h"
 
 PCD_HandleTypeDef hpcd;
 USBD_HandleTypeDef USBD_Device;
 
+#ifdef USB_DMA
+#define BUILD_DMA USB_BUILD_DMA
+#else
+#define BUILD_DMA 0
+#endif
+#ifdef TRACE
+#define BUILD_TRACE USB_BUILD_TRACE
+#else
+#define BUILD_TRACE 0
+#endif
+
+Usb_stats usb_stats = {.report_id = USB_REPORT_ID_STATS, .build = BUILD_DMA | BUILD_TRACE};
+Usb_surface usb_surface = {.report_id = USB_REPORT_ID_SURFACE};
+Usb_boot usb_boot = {.report_id = USB_REPORT_ID_BOOT, .handoff = BOOT_NO_HANDOFF};
+#ifdef TRACE
+Trace trace = {.report_id = USB_REPORT_ID_TRACE, .cycles_per_us = CYCLES_PER_US};
+#endif
+uint32_t usb_commit_at;
+volatile uint32_t usb_sof_at;
+
 static void FlushRxFifo(USB_OTG_GlobalTypeDef *USBx)
 {
   USBx->GRSTCTL = USB_OTG_GRSTCTL_RXFFLSH;
@@ -77,8 +100,12 @@ void usb_init(int hs_usb)
 	hpcd.Init.speed = hs_usb ? PCD_SPEED_HIGH : PCD_SPEED_HIGH_IN_FULL;
 	hpcd.Init.vbus_sensing_enable = 0;
 	hpcd.Init.phy_itface = USB_OTG_HS_EMBEDDED_PHY; // assumes
-	hpcd.Init.use_dedicated_ep1 = 0; // code assumes 0
-	hpcd.Init.dma_enable = 0; // code assumes 0
+	hpcd.Init.use_dedicated_ep1 = 1; // EP1 IN on OTG_HS_EP1_IN_IRQHandler
+#ifdef USB_DMA
+	hpcd.Init.dma_enable = 1;
+#else
+	hpcd.Init.dma_enable = 0;
+#endif
 	hpcd.Init.low_power_enable = 0; // code assumes 0
 	hpcd.Init.lpm_enable = 0; // code assumes 0
 	hpcd.Init.Sof_enable = 0; // code assumes 0
@@ -90,8 +117,11 @@ void usb_init(int hs_usb)
 	SET_BIT(RCC->APB2ENR, RCC_APB2ENR_OTGPHYCEN);
 	SET_BIT(RCC->AHB1ENR, RCC_AHB1ENR_OTGHSEN);
 	SET_BIT(RCC->AHB1ENR, RCC_AHB1ENR_OTGHSULPIEN);
-//	NVIC_SetPriority(OTG_HS_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 5, 0));
+	NVIC_SetPriority(OTG_HS_IRQn, USB_PRIO_SOF);
+	NVIC_SetPriority(OTG_HS_EP1_IN_IRQn, USB_PRIO_EP1);
+	NVIC_SetPriority(PendSV_IRQn, USB_PRIO_CTRL);
 	NVIC_EnableIRQ(OTG_HS_IRQn);
+	NVIC_EnableIRQ(OTG_HS_EP1_IN_IRQn);
 	// HAL_PCD_Init
 	hpcd.State = HAL_PCD_STATE_BUSY;
 	hpcd.Instance->GAHBCFG &= ~USB_OTG_GAHBCFG_GINT;
@@ -103,7 +133,7 @@ void usb_init(int hs_usb)
 	hpcd.Instance->GCCFG |= USB_OTG_GCCFG_PHYHSEN;
 	// USB_HS_PHYCInit(USBx)
 	USB_HS_PHYC->USB_HS_PHYC_LDO |= USB_HS_PHYC_LDO_ENABLE;
-	while ((USB_HS_PHYC->USB_HS_PHYC_LDO & USB_HS_PHYC_LDO_STATUS) == 0U);
+	int ok = cycles_poll(USB_HS_PHYC->USB_HS_PHYC_LDO & USB_HS_PHYC_LDO_STATUS, 2000);
 	if (HSE_VALUE == 24000000U) {
 		USB_HS_PHYC->USB_HS_PHYC_PLL = (0x4U << 1);
 	} else if (HSE_VALUE == 25000000U) {
@@ -111,15 +141,22 @@ void usb_init(int hs_usb)
 	}
 	USB_HS_PHYC->USB_HS_PHYC_TUNE |= USB_HS_PHYC_TUNE_VALUE;
 	USB_HS_PHYC->USB_HS_PHYC_PLL |= USB_HS_PHYC_PLL_PLLEN;
-	HAL_Delay(2);
 	// USB_CoreReset(USBx)
-	while ((hpcd.Instance->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL) == 0U);
+	// the PLL has no lock flag, but the core reset only completes once the
+	// PHY clock runs, so it replaces the fixed wait for the PLL
+	ok &= cycles_poll(hpcd.Instance->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL, 10000);
 	hpcd.Instance->GRSTCTL |= USB_OTG_GRSTCTL_CSRST;
-	while ((hpcd.Instance->GRSTCTL & USB_OTG_GRSTCTL_CSRST) == USB_OTG_GRSTCTL_CSRST);
+	ok &= cycles_poll((hpcd.Instance->GRSTCTL & USB_OTG_GRSTCTL_CSRST) == 0, 10000);
+	boot_mark(BOOT_USB_PHY, ok);
+	if (hpcd.Init.dma_enable == 1U) {
+		hpcd.Instance->GAHBCFG |= USB_OTG_GAHBCFG_HBSTLEN_2;
+		hpcd.Instance->GAHBCFG |= USB_OTG_GAHBCFG_DMAEN;
+	}
 	// USB_SetCurrentMode(hpcd->Instance, USB_DEVICE_MODE)
 	hpcd.Instance->GUSBCFG &= ~(USB_OTG_GUSBCFG_FHMOD | USB_OTG_GUSBCFG_FDMOD);
 	hpcd.Instance->GUSBCFG |= USB_OTG_GUSBCFG_FDMOD;
-	HAL_Delay(50U);
+	ok = cycles_poll((hpcd.Instance->GINTSTS & USB_OTG_GINTSTS_CMOD) == 0, 50000);
+	boot_mark(BOOT_USB_MODE, ok);
 	// HAL_PCD_Init
 	for (int i = 0; i < hpcd.Init.dev_endpoints; i++) {
 		hpcd.IN_ep[i].is_in = 1U;
@@ -198,7 +235,9 @@ void usb_init(int hs_usb)
 
 	hpcd.Instance->GINTMSK = 0U;
 	hpcd.Instance->GINTSTS = 0xBFFFFFFFU;
-	hpcd.Instance->GINTMSK |= USB_OTG_GINTMSK_RXFLVLM;
+	if (hpcd.Init.dma_enable == 0U) {
+		hpcd.Instance->GINTMSK |= USB_OTG_GINTMSK_RXFLVLM;
+	}
 	hpcd.Instance->GINTMSK |= USB_OTG_GINTMSK_USBSUSPM | USB_OTG_GINTMSK_USBRST |
 				   USB_OTG_GINTMSK_ENUMDNEM | USB_OTG_GINTMSK_IEPINT |
 				   USB_OTG_GINTMSK_OEPINT   | USB_OTG_GINTMSK_WUIM;
@@ -223,12 +262,13 @@ void usb_init(int hs_usb)
 	while (hpcd.Lock == HAL_LOCKED);
 	hpcd.Lock = HAL_LOCKED;
 	USBx_DEVICE->DCTL &= ~USB_OTG_DCTL_SDIS;
-	HAL_Delay(3);
+	// nothing to wait for here, the host resets the bus when it sees the pull-up
 	hpcd.Instance->GAHBCFG |= USB_OTG_GAHBCFG_GINT;
+	boot_mark(BOOT_USB_CONNECT, 1);
 	hpcd.Lock = HAL_UNLOCKED;
 }
 
-void usb_wait_configured(void)
+__ITCM void usb_wait_configured(void)
 {
 	volatile uint8_t *state = &USBD_Device.dev_state;
 	while (*state != USBD_STATE_CONFIGURED)
@@ -308,11 +348,49 @@ static HAL_StatusTypeDef PCD_EP_OutXfrComplete_int(PCD_HandleTypeDef *hpcd, uint
   USB_OTG_GlobalTypeDef *USBx = hpcd->Instance;
   uint32_t USBx_BASE = (uint32_t)USBx;
   uint32_t gSNPSiD = *(__IO uint32_t *)(&USBx->CID + 0x1U);
+  uint32_t DoepintReg = USBx_OUTEP(epnum)->DOEPINT;
 
-    if (gSNPSiD == USB_OTG_CORE_ID_310A)
+    if (hpcd->Init.dma_enable == 1U)
+    {
+      if ((DoepintReg & USB_OTG_DOEPINT_STUP) == USB_OTG_DOEPINT_STUP) /* Class C */
+      {
+        /* StupPktRcvd = 1 this is a setup packet */
+        if ((gSNPSiD > USB_OTG_CORE_ID_300A) &&
+            ((DoepintReg & USB_OTG_DOEPINT_STPKTRX) == USB_OTG_DOEPINT_STPKTRX))
+        {
+          CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_STPKTRX);
+        }
+      }
+      else if ((DoepintReg & USB_OTG_DOEPINT_OTEPSPR) == USB_OTG_DOEPINT_OTEPSPR) /* Class E */
+      {
+        CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_OTEPSPR);
+      }
+      else if ((gSNPSiD > USB_OTG_CORE_ID_300A) &&
+               ((DoepintReg & USB_OTG_DOEPINT_STPKTRX) == USB_OTG_DOEPINT_STPKTRX))
+      {
+        CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_STPKTRX);
+      }
+      else
+      {
+        /* out data packet received over EP0 */
+        hpcd->OUT_ep[epnum].xfer_count =
+          hpcd->OUT_ep[epnum].maxpacket -
+          (USBx_OUTEP(epnum)->DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ);
+
+        hpcd->OUT_ep[epnum].xfer_buff += hpcd->OUT_ep[epnum].maxpacket;
+
+        if ((epnum == 0U) && (hpcd->OUT_ep[epnum].xfer_len == 0U))
+        {
+          /* this is ZLP, so prepare EP0 for next setup */
+          (void)USB_EP0_OutStart(hpcd->Instance, 1U, (uint8_t *)hpcd->Setup);
+        }
+
+        HAL_PCD_DataOutStageCallback(hpcd, (uint8_t)epnum);
+      }
+    }
+    else if (gSNPSiD == USB_OTG_CORE_ID_310A)
     {
       /* StupPktRcvd = 1 this is a setup packet */
-   	  uint32_t DoepintReg = USBx_OUTEP(epnum)->DOEPINT;
       if ((DoepintReg & USB_OTG_DOEPINT_STPKTRX) == USB_OTG_DOEPINT_STPKTRX)
       {
         CLEAR_OUT_EP_INTR(epnum, USB_OTG_DOEPINT_STPKTRX);
@@ -332,7 +410,7 @@ static HAL_StatusTypeDef PCD_EP_OutXfrComplete_int(PCD_HandleTypeDef *hpcd, uint
       if ((epnum == 0U) && (hpcd->OUT_ep[epnum].xfer_len == 0U))
       {
         /* this is ZLP, so prepare EP0 for next setup */
-        (void)USB_EP0_OutStart(hpcd->Instance);
+        (void)USB_EP0_OutStart(hpcd->Instance, 0U, (uint8_t *)hpcd->Setup);
       }
 
       HAL_PCD_DataOutStageCallback(hpcd, (uint8_t)epnum);
@@ -363,6 +441,13 @@ static HAL_StatusTypeDef PCD_EP_OutSetupPacket_int(PCD_HandleTypeDef *hpcd, uint
 
   /* Inform the upper layer that a setup packet is available */
   HAL_PCD_SetupStageCallback(hpcd);
+  usb_stats.ctrl++;
+  trace_ev(TRACE_SETUP, ((uint8_t *)hpcd->Setup)[1], ((uint16_t *)hpcd->Setup)[1]);
+
+  if ((gSNPSiD > USB_OTG_CORE_ID_300A) && (hpcd->Init.dma_enable == 1U))
+  {
+    (void)USB_EP0_OutStart(hpcd->Instance, 1U, (uint8_t *)hpcd->Setup);
+  }
 
   return HAL_OK;
 }
@@ -370,27 +455,85 @@ static HAL_StatusTypeDef PCD_EP_OutSetupPacket_int(PCD_HandleTypeDef *hpcd, uint
 ///USBD_SetupReqTypedef stps[50];
 ///int istp;
 
-void OTG_HS_IRQHandler(void)
+// control sources that are handed to the bottom half
+#define USB_CTRL_INTR (USB_OTG_GINTSTS_RXFLVL | USB_OTG_GINTSTS_OEPINT | USB_OTG_GINTSTS_IEPINT | \
+		USB_OTG_GINTSTS_WKUINT | USB_OTG_GINTSTS_USBSUSP | USB_OTG_GINTSTS_USBRST | \
+		USB_OTG_GINTSTS_ENUMDNE)
+
+// sources masked by the top half, unmasked again when PendSV_Handler is done with them
+static uint32_t ctrl_pending;
+static uint32_t ctrl_pended_at; // cycles_now() when the first of them came in
+
+// top half: acknowledge SOF to wake the main loop, and defer everything else.
+// the control sources are masked in GINTMSK until the bottom half has run,
+// so a host request can't delay the report commit by more than this handler.
+__ITCM void OTG_HS_IRQHandler(void)
 {
-	if ((USB_OTG_HS->GINTSTS & USB_OTG_GINTSTS_SOF) != 0) {
-		USB_OTG_HS->GINTSTS |= USB_OTG_GINTSTS_SOF;
-		return;
+	const uint32_t gintsts = USB_OTG_HS->GINTSTS;
+	if ((gintsts & USB_OTG_GINTSTS_SOF) != 0) {
+		usb_sof_at = cycles_now();
+		USB_OTG_HS->GINTSTS = USB_OTG_GINTSTS_SOF;
 	}
 
+	const uint32_t ctrl = gintsts & USB_OTG_HS->GINTMSK & USB_CTRL_INTR;
+	if (ctrl != 0) {
+		USB_OTG_HS->GINTMSK &= ~ctrl;
+		if (ctrl_pending == 0)
+			ctrl_pended_at = cycles_now();
+		ctrl_pending |= ctrl;
+		SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+	}
+}
+
+// only EP1 IN is routed here (see USBD_LL_OpenEP), and only XFRC is unmasked
+__ITCM void OTG_HS_EP1_IN_IRQHandler(void)
+{
+	const uint32_t USBx_BASE = (uint32_t)USB_OTG_HS;
+	if ((USBx_INEP(1)->DIEPINT & USB_OTG_DIEPINT_XFRC) != 0) {
+		CLEAR_IN_EP_INTR(1, USB_OTG_DIEPINT_XFRC);
+		// the host has the report. late if it arrives while BASEPRI is raised.
+		const uint32_t wire = cycles_now() - usb_commit_at;
+		usb_stats.wire_cycles += wire;
+		usb_stats.wire_max = MAX(usb_stats.wire_max, wire);
+		// no HAL_PCD_DataInStageCallback, the HID class doesn't send these
+		// reports, and it runs from flash, which config_step may keep busy
+	}
+}
+
+// no control transfer between setup and data stage done, and nothing for the
+// bottom half. ep0_state stays at STATUS_IN/OUT after the last transfer.
+__ITCM int usb_ctrl_idle(void)
+{
+	const uint32_t ep0 = USBD_Device.ep0_state;
+	return ctrl_pending == 0 && ep0 != USBD_EP0_SETUP
+			&& ep0 != USBD_EP0_DATA_IN && ep0 != USBD_EP0_DATA_OUT;
+}
+
+// bottom half: runs at the lowest priority, after the main loop has committed its report
+void PendSV_Handler(void)
+{
   USB_OTG_GlobalTypeDef *USBx = hpcd.Instance;
   uint32_t USBx_BASE = (uint32_t)USBx;
 
-	// this is disabled by main loop
-	USBx_DEVICE->DIEPMSK |= USB_OTG_DIEPMSK_XFRCM;
+  // GINTMSK no longer has these bits set, so __HAL_PCD_GET_FLAG can't be used here
+  const uint32_t start = cycles_now();
+  __disable_irq();
+  const uint32_t pending = ctrl_pending;
+  ctrl_pending = 0;
+  const uint32_t wait = start - ctrl_pended_at;
+  __enable_irq();
+  usb_stats.ctrl_wait_max = MAX(usb_stats.ctrl_wait_max, wait);
+  trace_ev(TRACE_CTRL_BEGIN, 0, (uint16_t)(pending >> 4));
+  const uint32_t gintsts = USBx->GINTSTS & pending;
+#define PCD_FLAG(__INTERRUPT__) ((gintsts & (__INTERRUPT__)) == (__INTERRUPT__))
 
   uint32_t i, ep_intr, epint, epnum;
   uint32_t fifoemptymsk, temp;
   USB_OTG_EPTypeDef *ep;
 ///  abcd[a++]=',';
      /* Handle RxQLevel Interrupt */
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_RXFLVL))
+    if (PCD_FLAG(USB_OTG_GINTSTS_RXFLVL))
     {///abcd[a++]='R';
-      USB_MASK_INTERRUPT(hpcd.Instance, USB_OTG_GINTSTS_RXFLVL);
       temp = USBx->GRXSTSP;
       uint32_t pktsts = (temp & USB_OTG_GRXSTSP_PKTSTS) >> 17;
       ep = &hpcd.OUT_ep[temp & USB_OTG_GRXSTSP_EPNUM];
@@ -400,10 +543,15 @@ void OTG_HS_IRQHandler(void)
 ///USBD_ParseSetupRequest(&stps[istp++], (uint8_t *)hpcd.Setup);
         ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
       }
-      USB_UNMASK_INTERRUPT(hpcd.Instance, USB_OTG_GINTSTS_RXFLVL);
+      else if (pktsts == STS_DATA_UPDT && (temp & USB_OTG_GRXSTSP_BCNT) != 0U)
+      {
+        (void)USB_ReadPacket(USBx, ep->xfer_buff, (uint16_t)((temp & USB_OTG_GRXSTSP_BCNT) >> 4));
+        ep->xfer_buff += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
+        ep->xfer_count += (temp & USB_OTG_GRXSTSP_BCNT) >> 4;
+      }
     }
 
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_OEPINT))
+    if (PCD_FLAG(USB_OTG_GINTSTS_OEPINT))
     {///abcd[a++]='O';
       /* Read in the device interrupt bits */
       ep_intr = USB_ReadDevAllOutEpInterrupt(hpcd.Instance);
@@ -429,7 +577,7 @@ void OTG_HS_IRQHandler(void)
       }
     }
 
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_IEPINT))
+    if (PCD_FLAG(USB_OTG_GINTSTS_IEPINT))
     {///abcd[a++]='I';
       /* Read in the device interrupt bits */
       ep_intr = USB_ReadDevAllInEpInterrupt(hpcd.Instance);
@@ -447,6 +595,18 @@ void OTG_HS_IRQHandler(void)
 
             CLEAR_IN_EP_INTR(epnum, USB_OTG_DIEPINT_XFRC);
 
+            if (hpcd.Init.dma_enable == 1U)
+            {
+              hpcd.IN_ep[epnum].xfer_buff += hpcd.IN_ep[epnum].maxpacket;
+
+              /* this is ZLP, so prepare EP0 for next setup */
+              if ((epnum == 0U) && (hpcd.IN_ep[epnum].xfer_len == 0U))
+              {
+                /* prepare to rx more setup packets */
+                (void)USB_EP0_OutStart(hpcd.Instance, 1U, (uint8_t *)hpcd.Setup);
+              }
+            }
+
             HAL_PCD_DataInStageCallback(&hpcd, (uint8_t)epnum);
           }
 
@@ -459,7 +619,7 @@ void OTG_HS_IRQHandler(void)
     }
 
     /* Handle Resume Interrupt */
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_WKUINT))
+    if (PCD_FLAG(USB_OTG_GINTSTS_WKUINT))
     {///abcd[a++]='W';
       /* Clear the Remote Wake-up Signaling */
       USBx_DEVICE->DCTL &= ~USB_OTG_DCTL_RWUSIG;
@@ -468,7 +628,7 @@ void OTG_HS_IRQHandler(void)
     }
 
     /* Handle Suspend Interrupt */
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_USBSUSP))
+    if (PCD_FLAG(USB_OTG_GINTSTS_USBSUSP))
     {///abcd[a++]='S';
       if ((USBx_DEVICE->DSTS & USB_OTG_DSTS_SUSPSTS) == USB_OTG_DSTS_SUSPSTS) {
         HAL_PCD_SuspendCallback(&hpcd);
@@ -477,7 +637,7 @@ void OTG_HS_IRQHandler(void)
     }
 
     /* Handle Reset Interrupt */
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_USBRST)) {///abcd[a++]='T';
+    if (PCD_FLAG(USB_OTG_GINTSTS_USBRST)) {///abcd[a++]='T';
       USBx_DEVICE->DCTL &= ~USB_OTG_DCTL_RWUSIG;
       FlushTxFifo(hpcd.Instance, 0x10);
       for (i = 0U; i < hpcd.Init.dev_endpoints; i++) {
@@ -491,13 +651,15 @@ void OTG_HS_IRQHandler(void)
       USBx_DEVICE->DAINTMSK |= 0x10001U;
       USBx_DEVICE->DOEPMSK |= USB_OTG_DOEPMSK_STUPM | USB_OTG_DOEPMSK_XFRCM;
       USBx_DEVICE->DIEPMSK |= USB_OTG_DIEPMSK_XFRCM;
+      USBx_DEVICE->DINEP1MSK |= USB_OTG_DIEPEACHMSK1_XFRCM;
       USBx_DEVICE->DCFG &= ~USB_OTG_DCFG_DAD; /* Set Default Address to 0 */
-      (void)USB_EP0_OutStart(hpcd.Instance); /* setup EP0 to receive SETUP packets */
+      /* setup EP0 to receive SETUP packets */
+      (void)USB_EP0_OutStart(hpcd.Instance, (uint8_t)hpcd.Init.dma_enable, (uint8_t *)hpcd.Setup);
       __HAL_PCD_CLEAR_FLAG(&hpcd, USB_OTG_GINTSTS_USBRST);
     }
 
     /* Handle Enumeration done Interrupt */
-    if (__HAL_PCD_GET_FLAG(&hpcd, USB_OTG_GINTSTS_ENUMDNE))
+    if (PCD_FLAG(USB_OTG_GINTSTS_ENUMDNE))
     {///abcd[a++]='E';
       (void)USB_ActivateSetup(hpcd.Instance);
       hpcd.Init.speed = USB_GetDevSpeed(hpcd.Instance);
@@ -508,5 +670,16 @@ void OTG_HS_IRQHandler(void)
       HAL_PCD_ResetCallback(&hpcd);
       __HAL_PCD_CLEAR_FLAG(&hpcd, USB_OTG_GINTSTS_ENUMDNE);
     }
+#undef PCD_FLAG
+
+    // hand the sources back to the top half. anything that fired meanwhile
+    // is still latched in GINTSTS and pends this handler again.
+    __disable_irq();
+    USBx->GINTMSK |= pending;
+    __enable_irq();
+    const uint32_t run = cycles_now() - start;
+    usb_stats.ctrl_runs++;
+    usb_stats.ctrl_cycles += run;
+    usb_stats.ctrl_max = MAX(usb_stats.ctrl_max, run);
+    trace_ev(TRACE_CTRL_END, 0, 0);
 }
-
@@ -92,10 +92,28 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Copy the ITCM code from flash */
+  ldr r0, =_sitcm_text
+  ldr r1, =_eitcm_text
+  ldr r2, =_siitcm
+  movs r3, #0
+  b LoopCopyITCMInit
+
+CopyITCMInit:
+  ldr r4, [r2, r3]
+  str r4, [r0, r3]
+  adds r3, r3, #4
+
+LoopCopyITCMInit:
+  adds r4, r0, r3
+  cmp r4, r1
+  bcc CopyITCMInit
+
 /* Call static constructors */
   bl __libc_init_array
-/* Call the application's entry point.*/
-  bl main
+/* Call the application's entry point, which is in ITCM and out of bl range.*/
+  ldr r0, =main
+  blx r0
 
 LoopForever:
     b LoopForever
@@ -0,0 +1,39 @@
+#!/bin/sh
+# MIT License, Copyright (c) 2023 Zaunkoenig GmbH, see the other tools.
+#
+# times DFU downloads to the M3K bootloader, for comparing bootloader builds
+# (usb speed, wTransferSize) on the same host. the mouse has to be in the
+# bootloader already, each run writes image to the application area.
+#
+#   dfu_speed.sh image.bin [runs]
+#
+# prints the negotiated speed from sysfs (480 or 12), then seconds and KB/s
+# per run, erase included.
+
+set -e
+
+image=$1
+runs=${2:-3}
+dev=0483:df11 # M3K_USB_VID, USBD_PID in bootloader/Src/usbd_desc.c
+addr=0x08008000 # USBD_DFU_APP_DEFAULT_ADD
+
+if [ ! -f "$image" ]; then
+	echo "usage: $0 image.bin [runs]" >&2
+	exit 1
+fi
+
+for d in /sys/bus/usb/devices/*; do
+	if [ "$(cat "$d/idVendor" 2>/dev/null)" = 0483 ] && [ "$(cat "$d/idProduct" 2>/dev/null)" = df11 ]; then
+		echo "speed $(cat "$d/speed")"
+	fi
+done
+
+bytes=$(wc -c < "$image")
+i=0
+while [ $i -lt "$runs" ]; do
+	start=$(date +%s.%N)
+	dfu-util -q -d $dev -a 0 -s $addr -D "$image" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end $bytes" | awk '{ s = $2 - $1; printf "secs %.3f kbps %.1f\n", s, $3 / 1024 / s }'
+	i=$((i + 1))
+done
@@ -0,0 +1,487 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// report interval analyser for the M3K on linux.
+//
+//   cc -O2 -o evdev_rate evdev_rate.c -lpthread -lm
+//
+//   evdev_rate [-t secs] [-r hz] [-w capture] /dev/input/eventN
+//   evdev_rate [-r hz] capture
+//   evdev_rate [-t secs] [-r hz] -S hz[,pattern]
+//
+// every SYN_REPORT is one HID report, the kernel timestamps it when the
+// interrupt transfer completes. move the mouse while measuring, the M3K only
+// reports when something changed. intervals much longer than the nominal one
+// count as idle and are left out.
+//
+// -w stores the raw input_event stream, which is also what a capture argument
+// reads back (cat /dev/input/eventN > capture works too).
+//
+// -S creates a uinput mouse that reports at hz following a pattern, and
+// analyses that instead. patterns: steady, miss:N (drop every Nth report),
+// coalesce:N (every Nth report lands with the next one), jitter:US (uniform
+// +-US). it only exercises this tool, uinput timing is as good as the
+// scheduler.
+//
+// -r checks against the rate that CONFIG_INTERVAL is set to. exit status is 1
+// if the measured interval doesn't match it, 2 if the kernel dropped events.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define READ_BATCH 512 // events per read(), ~50ms worth at 8kHz
+#define IDLE_FACTOR 8 // intervals above this many nominal ones are idle
+#define HIST_BINS 32 // of nominal/8 each, up to 4x nominal
+
+// by CONFIG_INTERVAL, see loop_hs in main.c
+static const int config_hz[4] = {8000, 4000, 2000, 1000};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+typedef struct {
+	int64_t *t; // SYN_REPORT timestamps in us
+	size_t len, cap;
+	uint64_t events;
+	uint64_t dropped; // SYN_DROPPED seen
+} Capture;
+
+static void capture_add(Capture *c, const int64_t t)
+{
+	if (c->len == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 65536;
+		c->t = realloc(c->t, c->cap * sizeof(*c->t));
+		if (c->t == NULL) {
+			perror("realloc");
+			exit(3);
+		}
+	}
+	c->t[c->len++] = t;
+}
+
+static void capture_event(Capture *c, const struct input_event *ev)
+{
+	c->events++;
+	if (ev->type != EV_SYN)
+		return;
+	if (ev->code == SYN_DROPPED)
+		c->dropped++;
+	else if (ev->code == SYN_REPORT)
+		capture_add(c, (int64_t)ev->input_event_sec * 1000000 + ev->input_event_usec);
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// read until stop, the timeout or the end of a capture file
+static int capture_read(Capture *c, const char *path, const double secs, FILE *out)
+{
+	const int fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	const int live = S_ISCHR(st.st_mode);
+	if (live) {
+		int clk = CLOCK_MONOTONIC;
+		ioctl(fd, EVIOCSCLOCKID, &clk);
+		char name[256] = "?";
+		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+		fprintf(stderr, "reading %s (%s)%s\n", path, name, secs > 0 ? "" : ", ^C to stop");
+	}
+
+	const int64_t end = secs > 0 ? now_us() + (int64_t)(secs * 1e6) : INT64_MAX;
+	struct input_event ev[READ_BATCH];
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	while (!stop && now_us() < end) {
+		if (live && poll(&pfd, 1, 100) <= 0)
+			continue;
+		const ssize_t n = read(fd, ev, sizeof(ev));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0)
+			break; // end of capture, or the device went away
+		const size_t cnt = (size_t)n / sizeof(ev[0]);
+		if (out != NULL)
+			fwrite(ev, sizeof(ev[0]), cnt, out);
+		for (size_t i = 0; i < cnt; i++)
+			capture_event(c, &ev[i]);
+	}
+	close(fd);
+	return 0;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// nearest CONFIG_INTERVAL rate to an interval in us
+static int config_of(const double us)
+{
+	int best = 0;
+	for (int i = 1; i < 4; i++)
+		if (fabs(1e6 / config_hz[i] - us) < fabs(1e6 / config_hz[best] - us))
+			best = i;
+	return best;
+}
+
+typedef struct {
+	double nominal; // us
+	int64_t median;
+	uint64_t reports, coalesced, missed, idles, hist[HIST_BINS + 1];
+	double active_us;
+	// the regular intervals, neither coalesced nor after a miss
+	uint64_t regular;
+	double sum, sum2, dev_max;
+	int64_t *dev; // deviations from nominal, sorted, nd of them
+	size_t nd;
+} Counts;
+
+// a late report shows as a long interval followed by a short one. that is
+// one coalesced report, the slots the pair spans beyond its two reports are
+// missed. a long interval on its own is only misses.
+static void count(const int64_t *iv, const size_t n, const double nominal, const int64_t idle, Counts *k)
+{
+	for (size_t i = 0; i < n; i++) {
+		const int64_t d = iv[i];
+		if (d > idle) {
+			k->idles++;
+			continue;
+		}
+		k->reports++;
+		k->active_us += d;
+		const size_t bin = (size_t)(d / (nominal / 8));
+		k->hist[bin < HIST_BINS ? bin : HIST_BINS]++;
+		if (d < nominal / 2) {
+			k->coalesced++; // delivered with the previous one, one poll late
+		} else if (d >= nominal * 1.5 && i + 1 < n && iv[i + 1] < nominal / 2) {
+			const int64_t d2 = iv[++i];
+			k->reports++;
+			k->active_us += d2;
+			const size_t bin2 = (size_t)(d2 / (nominal / 8));
+			k->hist[bin2 < HIST_BINS ? bin2 : HIST_BINS]++;
+			k->coalesced++;
+			const long long slots = llround((d + d2) / nominal);
+			k->missed += slots > 2 ? (uint64_t)(slots - 2) : 0;
+		} else if (d >= nominal * 1.5) {
+			k->missed += (uint64_t)llround(d / nominal) - 1;
+		} else {
+			k->regular++;
+			k->sum += d;
+			k->sum2 += (double)d * d;
+			const double e = fabs(d - nominal);
+			k->dev_max = e > k->dev_max ? e : k->dev_max;
+			k->dev[k->nd++] = (int64_t)llround(e);
+		}
+	}
+}
+
+// fills k from a capture of at least 3 reports, free k->dev after
+static void measure(const Capture *c, const int expect_hz, Counts *k)
+{
+	const size_t n = c->len - 1;
+	int64_t *iv = malloc(n * sizeof(*iv));
+	int64_t *sorted = malloc(n * sizeof(*sorted));
+	for (size_t i = 0; i < n; i++)
+		iv[i] = sorted[i] = c->t[i + 1] - c->t[i];
+	qsort(sorted, n, sizeof(*sorted), cmp_i64);
+
+	// the nominal interval is what CONFIG_INTERVAL is set to, or the median
+	// snapped to the closest setting
+	*k = (Counts){.median = sorted[n / 2], .dev = malloc(n * sizeof(int64_t))};
+	k->nominal = 1e6 / (expect_hz > 0 ? expect_hz : config_hz[config_of((double)k->median)]);
+	const int64_t idle = (int64_t)(k->nominal * IDLE_FACTOR) > 20000 ? (int64_t)(k->nominal * IDLE_FACTOR) : 20000;
+	count(iv, n, k->nominal, idle, k);
+	qsort(k->dev, k->nd, sizeof(*k->dev), cmp_i64);
+	free(iv);
+	free(sorted);
+}
+
+// returns the CONFIG_INTERVAL the capture looks like, -1 if too short
+static int analyse(const Capture *c, const int expect_hz)
+{
+	if (c->len < 3) {
+		fprintf(stderr, "only %zu reports, move the mouse while measuring\n", c->len);
+		return -1;
+	}
+	Counts k;
+	measure(c, expect_hz, &k);
+	const uint64_t reports = k.reports, coalesced = k.coalesced, missed = k.missed;
+	const uint64_t *hist = k.hist;
+	const double nominal = k.nominal, active_us = k.active_us, dev_max = k.dev_max;
+	const int64_t *dev = k.dev;
+	const size_t nd = k.nd;
+
+	const double mean = k.regular ? k.sum / k.regular : 0;
+	const double sd = k.regular ? sqrt(fmax(k.sum2 / k.regular - mean * mean, 0)) : 0;
+	const int measured = config_of(mean > 0 ? mean : (double)k.median);
+	printf("reports      %zu in %.3fs active, %lu idle gaps, %lu events\n",
+			c->len, active_us / 1e6, (unsigned long)k.idles, (unsigned long)c->events);
+	printf("nominal      %.1fus (%.0fHz)%s\n", nominal, 1e6 / nominal,
+			expect_hz > 0 ? "" : ", guessed from the median");
+	printf("effective    %.1fHz\n", active_us > 0 ? reports * 1e6 / active_us : 0);
+	printf("interval     mean %.2fus sd %.2fus\n", mean, sd);
+	if (nd)
+		printf("jitter       p50 %ldus p99 %ldus p99.9 %ldus max %.0fus\n",
+				(long)dev[nd / 2], (long)dev[nd * 99 / 100], (long)dev[nd * 999 / 1000], dev_max);
+	printf("coalesced    %lu (%.3f%%)\n", (unsigned long)coalesced, reports ? 100.0 * coalesced / reports : 0);
+	printf("missed       %lu (%.3f%%)\n", (unsigned long)missed, reports ? 100.0 * missed / (reports + missed) : 0);
+	if (c->dropped)
+		printf("SYN_DROPPED  %lu, the reader fell behind, numbers are off\n", (unsigned long)c->dropped);
+	printf("looks like   CONFIG_INTERVAL %d (%dHz)\n", measured, config_hz[measured]);
+
+	uint64_t peak = 1;
+	for (int i = 0; i <= HIST_BINS; i++)
+		peak = hist[i] > peak ? hist[i] : peak;
+	printf("\n");
+	for (int i = 0; i <= HIST_BINS; i++) {
+		if (hist[i] == 0)
+			continue;
+		if (i < HIST_BINS)
+			printf("%7.1fus %9lu ", i * nominal / 8, (unsigned long)hist[i]);
+		else
+			printf("  longer  %9lu ", (unsigned long)hist[i]);
+		for (uint64_t b = 0; b < hist[i] * 50 / peak; b++)
+			putchar('#');
+		putchar('\n');
+	}
+
+	free(k.dev);
+	return measured;
+}
+
+typedef struct {
+	int hz;
+	char kind; // 's'teady, 'm'iss, 'c'oalesce, 'j'itter
+	int arg;
+	double secs;
+	int fd;
+} Synth;
+
+static void synth_emit(const int fd)
+{
+	const struct input_event ev[2] = {
+		{.type = EV_REL, .code = REL_X, .value = 1},
+		{.type = EV_SYN, .code = SYN_REPORT, .value = 0},
+	};
+	if (write(fd, ev, sizeof(ev)) != sizeof(ev))
+		perror("uinput write");
+}
+
+// when report i (from 1) goes out, in ns from the start, -1 if it doesn't
+static int64_t synth_at(const Synth *s, const uint64_t i, const int64_t period)
+{
+	int64_t at = (int64_t)i * period;
+	if (s->kind == 'j')
+		at += ((int64_t)(rand() % (2 * s->arg + 1)) - s->arg) * 1000;
+	if (s->kind == 'm' && i % s->arg == 0)
+		return -1;
+	if (s->kind == 'c' && i % s->arg == 0)
+		at += period; // sent back to back with the next one
+	return at;
+}
+
+static void *synth_run(void *arg)
+{
+	const Synth *s = arg;
+	struct sched_param sp = {.sched_priority = sched_get_priority_max(SCHED_FIFO)};
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp); // best effort
+
+	const int64_t period = 1000000000LL / s->hz;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	const int64_t start = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	const int64_t end = (int64_t)(s->secs * 1e9);
+	for (uint64_t i = 1; (int64_t)i * period < end && !stop; i++) {
+		const int64_t rel = synth_at(s, i, period);
+		if (rel < 0)
+			continue;
+		const int64_t at = start + rel;
+		ts.tv_sec = at / 1000000000LL;
+		ts.tv_nsec = at % 1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		synth_emit(s->fd);
+	}
+	return NULL;
+}
+
+// uinput mouse, returns its fd and fills in the event node
+static int synth_create(char *node, const size_t len)
+{
+	const int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror("/dev/uinput");
+		return -1;
+	}
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+	ioctl(fd, UI_SET_EVBIT, EV_REL);
+	ioctl(fd, UI_SET_RELBIT, REL_X);
+	ioctl(fd, UI_SET_RELBIT, REL_Y);
+	struct uinput_setup us = {.id = {.bustype = BUS_VIRTUAL, .vendor = 0x0483, .product = 0xA462}};
+	snprintf(us.name, sizeof(us.name), "M3K evdev_rate synth");
+	if (ioctl(fd, UI_DEV_SETUP, &us) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+		perror("uinput setup");
+		close(fd);
+		return -1;
+	}
+
+	char sys[64], dir[128];
+	if (ioctl(fd, UI_GET_SYSNAME(sizeof(sys)), sys) < 0) {
+		perror("UI_GET_SYSNAME");
+		close(fd);
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "/sys/devices/virtual/input/%s", sys);
+	node[0] = 0;
+	for (int tries = 0; tries < 50 && node[0] == 0; tries++) { // udev needs a moment
+		DIR *d = opendir(dir);
+		struct dirent *e;
+		while (d != NULL && (e = readdir(d)) != NULL)
+			if (strncmp(e->d_name, "event", 5) == 0)
+				snprintf(node, len, "/dev/input/%s", e->d_name);
+		if (d != NULL)
+			closedir(d);
+		if (node[0] == 0 || access(node, R_OK) != 0) {
+			node[0] = 0;
+			usleep(20000);
+		}
+	}
+	if (node[0] == 0) {
+		fprintf(stderr, "no event node for %s\n", dir);
+		ioctl(fd, UI_DEV_DESTROY);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int synth_parse(Synth *s, const char *arg)
+{
+	char kind[16] = "steady";
+	s->arg = 0;
+	if (sscanf(arg, "%d,%15[a-z]:%d", &s->hz, kind, &s->arg) < 1 || s->hz <= 0)
+		return -1;
+	s->kind = kind[0];
+	if (strchr("smcj", s->kind) == NULL || (s->kind != 's' && s->arg <= 0))
+		return -1;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: evdev_rate [-t secs] [-r hz] [-w capture] /dev/input/eventN\n"
+			"       evdev_rate [-r hz] capture\n"
+			"       evdev_rate [-t secs] [-r hz] -S hz[,steady|miss:N|coalesce:N|jitter:US]\n");
+	exit(3);
+}
+
+#ifndef EVDEV_RATE_NO_MAIN // tools/test_evdev_rate.c has its own
+int main(int argc, char **argv)
+{
+	double secs = 0;
+	int expect_hz = 0;
+	const char *write_path = NULL, *synth_arg = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:w:S:")) != -1) {
+		switch (opt) {
+		case 't': secs = atof(optarg); break;
+		case 'r': expect_hz = atoi(optarg); break;
+		case 'w': write_path = optarg; break;
+		case 'S': synth_arg = optarg; break;
+		default: usage();
+		}
+	}
+	if ((synth_arg == NULL) == (optind >= argc))
+		usage();
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	FILE *out = NULL;
+	if (write_path != NULL && (out = fopen(write_path, "wb")) == NULL) {
+		perror(write_path);
+		return 3;
+	}
+
+	Capture c = {0};
+	if (synth_arg != NULL) {
+		Synth s = {.secs = secs > 0 ? secs : 5};
+		if (synth_parse(&s, synth_arg) < 0)
+			usage();
+		char node[300];
+		if ((s.fd = synth_create(node, sizeof(node))) < 0)
+			return 3;
+		// the reader runs here, the emitter in its own thread
+		pthread_t th;
+		pthread_create(&th, NULL, synth_run, &s);
+		capture_read(&c, node, s.secs + 1, out);
+		stop = 1;
+		pthread_join(th, NULL);
+		ioctl(s.fd, UI_DEV_DESTROY);
+		close(s.fd);
+	} else if (capture_read(&c, argv[optind], secs, out) < 0) {
+		return 3;
+	}
+	if (out != NULL)
+		fclose(out);
+
+	const int config = analyse(&c, expect_hz);
+	free(c.t);
+	if (c.dropped)
+		return 2;
+	if (config < 0 || (expect_hz > 0 && config_hz[config] != expect_hz))
+		return 1;
+	return 0;
+}
+#endif
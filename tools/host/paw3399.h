@@ -0,0 +1,51 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+// stands in for mouse/Inc/paw3399.h in the host tests, with the types and
+// the calls mouse/Inc/health.h uses. the test defines the calls and plays
+// the sensor behind them.
+
+#include <stdint.h>
+#include "config.h"
+
+typedef struct {
+	uint8_t stage;
+	uint8_t polls;
+	uint8_t timeouts;
+} Paw3399_init;
+
+typedef struct {
+	int profile;
+} Paw3399_image;
+
+#define PAW3399_POLL_US 100
+#define PAW3399_RESET_US 10000
+
+#define PAW3399_PRODUCT_ID     0x00
+#define PAW3399_INV_PRODUCT_ID 0x3F
+
+uint8_t paw3399_read(uint8_t addr);
+uint32_t paw3399_init_step(Paw3399_init *st, Config cfg);
+void paw3399_apply(const Paw3399_image *img);
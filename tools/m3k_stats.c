@@ -0,0 +1,238 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// reads Usb_stats (mouse/Inc/usb.h) from the M3K, for before/after
+// comparisons of firmware builds on the same host and the same movement.
+//
+//   make m3k_stats
+//
+//   m3k_stats [-t secs] [-o file] /dev/hidrawN
+//   m3k_stats -c before after
+//
+// reads the counters twice, secs apart (default 10), and prints what changed
+// in between: counts, averages per loop or report in us, and the worst cases
+// since boot. -o also writes that to a file, -c puts two such files side by
+// side. loop and build tell which loop variant and build options a capture
+// was taken with, e.g. USB_DMA against the fifo writes for commit_cycles and
+// wire_cycles. a capture is within one loop variant: for the cycles per
+// variant, set each interval in the programming mode and capture each, then
+// the same with a LOOP_GENERIC build.
+
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define USB_TYPES_ONLY
+#include "usb.h"
+
+#define CYCLES_PER_US 32.0 // as in cycles.h
+
+enum { COUNT, MAX, PER_LOOP, PER_SENT, PER_CTRL };
+
+static const struct {
+	const char *name;
+	size_t at;
+	int kind;
+} field[] = {
+#define F(f, kind) {#f, offsetof(Usb_stats, f), kind}
+	F(loops, COUNT),
+	F(sent, COUNT),
+	F(flushed, COUNT),
+	F(skipped, COUNT),
+	F(sof_missed, COUNT),
+	F(ctrl, COUNT),
+	F(loop_cycles, PER_LOOP),
+	F(loop_max, MAX),
+	F(wake_cycles, PER_LOOP),
+	F(wake_max, MAX),
+	F(wake_max_flash, MAX),
+	F(commit_cycles, PER_SENT),
+	F(wire_cycles, PER_SENT),
+	F(wire_max, MAX),
+	F(ctrl_runs, COUNT),
+	F(ctrl_cycles, PER_CTRL),
+	F(ctrl_max, MAX),
+	F(ctrl_wait_max, MAX),
+	F(flash_errors, COUNT),
+	F(sensor_fails, COUNT),
+	F(sensor_resets, COUNT),
+	F(sensor_recover_cycles, MAX), // of the last re-init
+#undef F
+};
+#define FIELDS (sizeof(field) / sizeof(field[0]))
+
+static uint32_t get(const Usb_stats *s, const int i)
+{
+	uint32_t v;
+	memcpy(&v, (const uint8_t *)s + field[i].at, sizeof(v));
+	return v;
+}
+
+static int read_stats(const int fd, Usb_stats *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->report_id = USB_REPORT_ID_STATS;
+	if (ioctl(fd, HIDIOCGFEATURE(sizeof(*s)), s) < (int)sizeof(*s)) {
+		perror("HIDIOCGFEATURE");
+		return 0;
+	}
+	return 1;
+}
+
+static void print(FILE *f, const Usb_stats *a, const Usb_stats *b, const double secs)
+{
+	const uint32_t loops = b->loops - a->loops;
+	const uint32_t sent = b->sent - a->sent;
+	const uint32_t ctrl = b->ctrl_runs - a->ctrl_runs;
+	fprintf(f, "loop 0x%02x\n", b->loop);
+	fprintf(f, "build 0x%02x\n", b->build); // USB_BUILD_*
+	fprintf(f, "secs %.3f\n", secs);
+	for (size_t i = 0; i < FIELDS; i++) {
+		const uint32_t d = get(b, i) - get(a, i); // the sums wrap
+		switch (field[i].kind) {
+		case COUNT:
+			fprintf(f, "%s %u\n", field[i].name, d);
+			break;
+		case MAX:
+			fprintf(f, "%s_us %.3f\n", field[i].name, get(b, i) / CYCLES_PER_US);
+			break;
+		case PER_LOOP:
+			fprintf(f, "%s_us %.3f\n", field[i].name, loops ? d / CYCLES_PER_US / loops : 0);
+			break;
+		case PER_SENT:
+			fprintf(f, "%s_us %.3f\n", field[i].name, sent ? d / CYCLES_PER_US / sent : 0);
+			break;
+		case PER_CTRL:
+			fprintf(f, "%s_us %.3f\n", field[i].name, ctrl ? d / CYCLES_PER_US / ctrl : 0);
+			break;
+		}
+	}
+}
+
+static int measure(const char *path, const double secs, const char *out)
+{
+	const int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	Usb_stats a, b;
+	if (!read_stats(fd, &a))
+		return 1;
+	usleep(secs * 1e6);
+	if (!read_stats(fd, &b))
+		return 1;
+	close(fd);
+	if (a.loop != b.loop) {
+		// the sums would mix two variants, loop_max was reset in between
+		fprintf(stderr, "loop variant changed from 0x%02x to 0x%02x, measure again\n", a.loop, b.loop);
+		return 1;
+	}
+	print(stdout, &a, &b, secs);
+	if (out) {
+		FILE *f = fopen(out, "w");
+		if (!f) {
+			perror(out);
+			return 1;
+		}
+		print(f, &a, &b, secs);
+		fclose(f);
+	}
+	return 0;
+}
+
+// "name value" lines, as print() writes them
+static int load(const char *path, char name[][64], double *v, const int max)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	int n = 0;
+	char line[128];
+	while (n < max && fgets(line, sizeof(line), f)) {
+		char *sp = strchr(line, ' ');
+		if (!sp)
+			continue;
+		*sp = '\0';
+		snprintf(name[n], 64, "%.63s", line);
+		v[n] = strtod(sp + 1, NULL); // also reads the 0x of loop
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static int compare(const char *before, const char *after)
+{
+	enum { MAX_LINES = 64 };
+	char na[MAX_LINES][64], nb[MAX_LINES][64];
+	double va[MAX_LINES], vb[MAX_LINES];
+	const int a = load(before, na, va, MAX_LINES);
+	const int b = load(after, nb, vb, MAX_LINES);
+	if (a < 0 || b < 0)
+		return 1;
+	printf("%-22s %12s %12s %8s\n", "", "before", "after", "change");
+	for (int i = 0; i < a; i++) {
+		for (int j = 0; j < b; j++) {
+			if (strcmp(na[i], nb[j]) != 0)
+				continue;
+			printf("%-22s %12.3f %12.3f", na[i], va[i], vb[j]);
+			if (va[i] != 0)
+				printf(" %+7.1f%%", (vb[j] - va[i]) / va[i] * 100);
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	double secs = 10;
+	const char *out = NULL;
+	int cmp = 0, opt;
+	while ((opt = getopt(argc, argv, "t:o:c")) != -1) {
+		switch (opt) {
+		case 't': secs = atof(optarg); break;
+		case 'o': out = optarg; break;
+		case 'c': cmp = 1; break;
+		default: goto usage;
+		}
+	}
+	if (cmp && argc - optind == 2)
+		return compare(argv[optind], argv[optind + 1]);
+	if (!cmp && argc - optind == 1 && secs > 0)
+		return measure(argv[optind], secs, out);
+usage:
+	fprintf(stderr,
+			"usage: m3k_stats [-t secs] [-o file] /dev/hidrawN\n"
+			"       m3k_stats -c before after\n");
+	return 2;
+}
@@ -0,0 +1,131 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// property test of the motion backlog (mouse/Inc/motion.h) through the
+// report pipeline (mouse/Inc/report.h): whatever the sensor deltas, interval
+// skips and reports the host never collects, the deltas the host receives
+// sum up to exactly the deltas the sensor gave, and every report field stays
+// within the descriptor's logical range.
+//
+//   make test_acc && ./test_acc [runs]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "report.h"
+#include "test.h"
+
+// sensor deltas, mostly small, sometimes the extremes of the 16 bit burst
+static int16_t rnd_delta(void)
+{
+	switch (rnd() % 8) {
+	case 0: return 32767;
+	case 1: return -32768;
+	case 2: return (int16_t)rnd();
+	default: return (int16_t)(rnd() % 4001) - 2000;
+	}
+}
+
+typedef struct {
+	int64_t x, y, whl;
+} Sum;
+
+// one run of loops, as loop_once() and uhid_bridge do it. the host stalls
+// for stretches of up to 100k loops, so the backlog goes far beyond int16.
+static int run(const int loops, const int skip, Sum *in, Sum *out, uint64_t *reports)
+{
+	int count = 0;
+	uint8_t btn = 0;
+	Usb_packet send = {0};
+	Motion_acc acc = {0};
+	int in_fifo = 0, stall = 0;
+
+	// keep going after the last sensor delta until the backlog is drained
+	for (int n = 0; n < loops || in_fifo || acc.x || acc.y || acc.whl; n++) {
+		int16_t x = 0, y = 0;
+		int8_t whl = 0;
+		if (n < loops) {
+			x = rnd_delta();
+			y = rnd_delta();
+			whl = (rnd() % 16 == 0) ? ((rnd() & 1) ? 1 : -1) : 0;
+			if (rnd() % 64 == 0)
+				btn ^= 1 << (rnd() % 3);
+			if (stall == 0 && rnd() % 20000 == 0)
+				stall = rnd() % 100000;
+		}
+		in->x += x;
+		in->y += y;
+		in->whl += whl;
+		acc_add(&acc, x, y, whl);
+
+		int resend = 0;
+		if (in_fifo) {
+			in_fifo = 0;
+			count = 0;
+			report_requeue(&acc, &send);
+			resend = 1;
+		}
+
+		if (report_next(&count, skip, &send, &acc, btn, resend) != REPORT_SEND)
+			continue;
+		if (stall > 0 || rnd() % 50 == 0) {
+			// left in the fifo, flushed next loop
+			if (stall > 0)
+				stall--;
+			in_fifo = 1;
+			continue;
+		}
+		if (send.whl == -128 || send.x == -32768 || send.y == -32768) {
+			fprintf(stderr, "report out of range: %d %d %d\n", send.x, send.y, send.whl);
+			return 0;
+		}
+		out->x += send.x;
+		out->y += send.y;
+		out->whl += send.whl;
+		(*reports)++;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const int runs = (argc > 1) ? atoi(argv[1]) : 200;
+	uint64_t reports = 0, loops = 0;
+	for (int r = 0; r < runs; r++) {
+		const int skip = (1 << (r % 4)) - 1; // CONFIG_INTERVAL 0..3
+		const int n = 1 + rnd() % 200000;
+		Sum in = {0}, out = {0};
+		if (!run(n, skip, &in, &out, &reports))
+			return 1;
+		loops += n;
+		if (in.x != out.x || in.y != out.y || in.whl != out.whl) {
+			fprintf(stderr, "run %d: sensor %lld,%lld,%lld != reported %lld,%lld,%lld\n", r,
+					(long long)in.x, (long long)in.y, (long long)in.whl,
+					(long long)out.x, (long long)out.y, (long long)out.whl);
+			return 1;
+		}
+	}
+	printf("test_acc: %d runs, %llu loops, %llu reports, sums match\n",
+			runs, (unsigned long long)loops, (unsigned long long)reports);
+	return 0;
+}
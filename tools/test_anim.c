@@ -0,0 +1,171 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// mouse/Src/anim.c on the host: run-length expansion of queued sequences,
+// a full queue, anim_num() all or nothing, and the time scale.
+// anim.c is included, so the test can look at and reset its queue.
+//
+//   make test_anim && ./test_anim
+
+#include <stdio.h>
+#include <string.h>
+#include "../mouse/Src/anim.c"
+#include "test.h"
+
+static void reset(void)
+{
+	queue_head = queue_tail = 0;
+	len_left = 0;
+	tick = 0;
+	anim_set_scale(1);
+}
+
+// reads until the queue is empty, returns how many, sums the motion
+static long drain(long *x, long *y)
+{
+	long n = 0;
+	*x = *y = 0;
+	while (len_left != 0) {
+		const struct Xy a = anim_read();
+		*x += a.x;
+		*y += a.y;
+		n++;
+	}
+	return n;
+}
+
+static void test_expand(void)
+{
+	reset();
+	static struct Anim seq[] = {ANIM(2, 1, 0), ANIM(1, 0, 5)};
+	CHECK(anim_add(3, 2, seq) == 1, "anim_add failed");
+	// 3 x (1,0) (1,0) (0,5), then nothing
+	for (int r = 0; r < 3; r++) {
+		for (int i = 0; i < 3; i++) {
+			const struct Xy a = anim_read();
+			const int x = (i < 2) ? 1 : 0, y = (i < 2) ? 0 : 5;
+			CHECK(a.x == x && a.y == y, "rep %d step %d: %d,%d instead of %d,%d", r, i, a.x, a.y, x, y);
+		}
+	}
+	const struct Xy a = anim_read();
+	CHECK(a.x == 0 && a.y == 0 && len_left == 0, "motion after the last rep");
+
+	// commands play in order, each one all its reps
+	static struct Anim one[] = {ANIM(1, 1, 0)};
+	static struct Anim two[] = {ANIM(1, 0, 1)};
+	CHECK(anim_add(2, 1, one) && anim_add(2, 1, two), "anim_add failed");
+	const int want[4][2] = {{1, 0}, {1, 0}, {0, 1}, {0, 1}};
+	for (int i = 0; i < 4; i++) {
+		const struct Xy b = anim_read();
+		CHECK(b.x == want[i][0] && b.y == want[i][1], "read %d: %d,%d", i, b.x, b.y);
+	}
+	CHECK(len_left == 0, "queue not empty");
+
+	// nothing to play is not an error
+	CHECK(anim_add(0, 1, one) == 1 && anim_add(1, 0, one) == 1 && len_left == 0, "empty add");
+}
+
+static void test_full(void)
+{
+	reset();
+	static struct Anim seq[] = {ANIM(1, 1, 0)};
+	for (int i = 0; i < QUEUE_SIZE; i++)
+		CHECK(anim_add(1, 1, seq) == 1, "add %d of %d failed", i, QUEUE_SIZE);
+	CHECK(anim_add(1, 1, seq) == 0, "add to a full queue succeeded");
+	CHECK(anim_add(UINT16_MAX + 1, 1, seq) == 0, "reps too large accepted");
+	// playing one frees its slot
+	(void)anim_read();
+	CHECK(anim_add(1, 1, seq) == 1, "no room after playing one");
+	long x, y;
+	CHECK(drain(&x, &y) == QUEUE_SIZE && x == QUEUE_SIZE, "%ld,%ld after draining", x, y);
+}
+
+static void test_num(void)
+{
+	// every number fits in the 4 commands a digit the check assumes
+	for (uint32_t v = 0; v <= UINT16_MAX; v++) {
+		reset();
+		anim_num(v);
+		const uint32_t n = queue_tail - queue_head;
+		CHECK(n > 0 && n <= 4 * 5, "anim_num(%u) queued %u commands", v, n);
+		if (fails)
+			return;
+	}
+
+	// all or nothing: with one slot too few, nothing is queued
+	reset();
+	static struct Anim seq[] = {ANIM(1, 0, 0)};
+	while (queue_free() >= 4 * 5)
+		anim_add(1, 1, seq);
+	const uint32_t tail = queue_tail;
+	anim_num(12345);
+	CHECK(queue_tail == tail, "anim_num queued %u commands into a short queue", queue_tail - tail);
+
+	// 8 ends where it started, each further digit HSPACE to the right
+	reset();
+	anim_num(8);
+	long x, y;
+	drain(&x, &y);
+	CHECK(x == 0 && y == 0, "8 ends at %ld,%ld", x, y);
+	reset();
+	anim_num(888);
+	drain(&x, &y);
+	CHECK(x == 2 * HSPACE && y == 0, "888 ends at %ld,%ld", x, y);
+}
+
+static void test_scale(void)
+{
+	static struct Anim seq[] = {ANIM(3, 1, 2), ANIM(2, -1, 0)};
+	reset();
+	anim_add(2, 2, seq);
+	long x1, y1;
+	const long n1 = drain(&x1, &y1);
+
+	// 8x slower at high speed, the same motion in the end
+	reset();
+	anim_set_scale(8);
+	anim_add(2, 2, seq);
+	long x8, y8;
+	const long n8 = drain(&x8, &y8);
+	CHECK(x8 == x1 && y8 == y1, "scaled motion %ld,%ld instead of %ld,%ld", x8, y8, x1, y1);
+	CHECK(n1 == 10 && n8 == 8 * (n1 - 1) + 1, "%ld reads scaled, %ld unscaled", n8, n1);
+
+	// one step every 8th read, none in between
+	reset();
+	anim_set_scale(8);
+	anim_add(1, 1, seq);
+	for (int i = 0; i < 17; i++) {
+		const struct Xy a = anim_read();
+		const int step = (i % 8) == 0;
+		CHECK((a.x != 0) == step, "read %d: %d,%d", i, a.x, a.y);
+	}
+}
+
+int main(void)
+{
+	test_expand();
+	test_full();
+	test_num();
+	test_scale();
+	return test_done("test_anim");
+}
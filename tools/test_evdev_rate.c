@@ -0,0 +1,120 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// replays known report patterns through evdev_rate's counting, no uinput or
+// input device needed. make test_evdev_rate && ./test_evdev_rate
+
+#define EVDEV_RATE_NO_MAIN
+// only the counting is used, not the capture and synth plumbing
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "evdev_rate.c"
+
+#include "test.h"
+
+// reports 1..n of a -S pattern, as a capture
+static void synth_capture(Capture *c, const char *pattern, const uint64_t n)
+{
+	Synth s;
+	if (synth_parse(&s, pattern) < 0) {
+		fprintf(stderr, "bad pattern %s\n", pattern);
+		exit(1);
+	}
+	const int64_t period = 1000000000LL / s.hz;
+	c->len = 0;
+	for (uint64_t i = 1; i <= n; i++) {
+		const int64_t at = synth_at(&s, i, period);
+		if (at >= 0)
+			capture_add(c, at / 1000);
+	}
+}
+
+// reports at the given multiples of the nominal interval, after a steady run
+static void late_capture(Capture *c, const double *at, const int n, const double nominal)
+{
+	c->len = 0;
+	for (int i = 0; i < 100; i++)
+		capture_add(c, (int64_t)(i * nominal));
+	for (int i = 0; i < n; i++)
+		capture_add(c, (int64_t)((100 + at[i]) * nominal));
+}
+
+static void expect(const Capture *c, const int hz, const char *what,
+		const uint64_t reports, const uint64_t coalesced, const uint64_t missed, const uint64_t idles)
+{
+	Counts k;
+	measure(c, hz, &k);
+	CHECK(k.reports == reports, "%s: %lu reports, expected %lu", what, (unsigned long)k.reports, (unsigned long)reports);
+	CHECK(k.coalesced == coalesced, "%s: %lu coalesced, expected %lu", what, (unsigned long)k.coalesced, (unsigned long)coalesced);
+	CHECK(k.missed == missed, "%s: %lu missed, expected %lu", what, (unsigned long)k.missed, (unsigned long)missed);
+	CHECK(k.idles == idles, "%s: %lu idle gaps, expected %lu", what, (unsigned long)k.idles, (unsigned long)idles);
+	free(k.dev);
+}
+
+int main(void)
+{
+	Capture c = {0};
+
+	for (int i = 0; i < 4; i++) {
+		char p[32];
+		snprintf(p, sizeof(p), "%d", config_hz[i]);
+		synth_capture(&c, p, 10000);
+		expect(&c, 0, p, 9999, 0, 0, 0);
+	}
+
+	// every 10th report missing, the last one is 10000 so no gap after it
+	synth_capture(&c, "1000,miss:10", 10000);
+	expect(&c, 0, "miss:10", 8999, 0, 999, 0);
+
+	// every 10th report a poll late, on top of the next one. one coalesced
+	// each, nothing missed
+	synth_capture(&c, "8000,coalesce:10", 10005);
+	expect(&c, 0, "coalesce:10", 10004, 1000, 0, 0);
+
+	// +-200us at 1000Hz stays regular
+	srand(1);
+	synth_capture(&c, "1000,jitter:200", 10000);
+	expect(&c, 0, "jitter:200", 9999, 0, 0, 0);
+
+	// late by 0.7 of an interval: 1.7 then 0.3, one coalesced, no miss
+	const double late[] = {0, 1.7, 2, 3};
+	late_capture(&c, late, 4, 125);
+	expect(&c, 8000, "late", 103, 1, 0, 0);
+
+	// a miss and then a late one: 2.7 then 0.3
+	const double miss_late[] = {0, 2.7, 3, 4};
+	late_capture(&c, miss_late, 4, 125);
+	expect(&c, 8000, "miss then late", 103, 1, 1, 0);
+
+	// a long interval on its own is misses, also before a regular one
+	const double miss3[] = {0, 4, 5};
+	late_capture(&c, miss3, 3, 125);
+	expect(&c, 8000, "miss 3", 102, 0, 3, 0);
+
+	// a pause is idle, whatever comes after it
+	const double pause[] = {0, 400, 400.2, 401.2};
+	late_capture(&c, pause, 4, 125);
+	expect(&c, 8000, "pause", 102, 1, 0, 1);
+
+	free(c.t);
+	return test_done("test_evdev_rate");
+}
@@ -0,0 +1,251 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// mouse/Inc/health.h on the host, against a PAW3399 double (host/paw3399.h)
+// and a simulated clock. the sensor drops out for a while, as on a
+// brown-out, and the test measures how long it takes from the drop-out to
+// a configured sensor again: detection by the checks, re-inits that time
+// out while it is off, and the last one, one init step per loop at most.
+// the drop-outs are longer than the detection, shorter ones go unnoticed,
+// see health.h.
+//
+//   make test_health && ./test_health
+
+#include <stdio.h>
+#include <stdlib.h>
+#define USB_TYPES_ONLY
+#include "usb.h"
+
+static Usb_stats usb_stats;
+
+#include "health.h"
+#include "test.h"
+
+// the clock
+static uint64_t now_us;
+
+uint32_t cycles_now(void)
+{
+	return (uint32_t)(now_us * CYCLES_PER_US);
+}
+
+// the sensor. it reads all 1s without power, and needs the full init after.
+static const uint8_t id[2] = {0x51, 0xAE};
+static int powered = 1;
+static int configured = 1;
+static int glitch = 0; // wrong reads to come
+static int flash_busy = 0;
+static int calls; // into the sensor during one loop
+static int applied = -1; // profile of the last paw3399_apply
+
+static void power(const int on)
+{
+	powered = on;
+	if (!on)
+		configured = 0;
+}
+
+uint8_t paw3399_read(const uint8_t addr)
+{
+	calls++;
+	CHECK(!flash_busy, "sensor read while the flash is busy");
+	if (!powered)
+		return 0xFF;
+	if (glitch > 0) {
+		glitch--;
+		return 0x00;
+	}
+	return (addr == PAW3399_PRODUCT_ID) ? id[0] : id[1];
+}
+
+// the waits of paw3399_init_step, stage by stage. 2 and 6 poll for an
+// answer after the reset minimum, 7 for the 0x6C ready flag, which the
+// double has at once.
+static const uint32_t stage_us[] = {10000, PAW3399_RESET_US, 1000, 1000, 1000, PAW3399_RESET_US, 992, 3000, 0};
+
+uint32_t paw3399_init_step(Paw3399_init *st, const Config cfg)
+{
+	(void)cfg;
+	calls++;
+	CHECK(!flash_busy, "init step while the flash is busy");
+	const int stage = st->stage++;
+	if ((stage == 2 || stage == 6) && !powered) {
+		if (++st->polls < 100) {
+			st->stage--;
+			return PAW3399_POLL_US;
+		}
+		st->timeouts++;
+	}
+	if (stage == 2 || stage == 6)
+		st->polls = 0;
+	if (stage >= 8) {
+		configured = powered && st->timeouts == 0;
+		return 0;
+	}
+	return stage_us[stage];
+}
+
+void paw3399_apply(const Paw3399_image *img)
+{
+	calls++;
+	applied = img->profile;
+}
+
+// the main loop around health_loop
+static Sensor_health h;
+static const Paw3399_image img = {1};
+
+static void boot(void)
+{
+	now_us = 1000;
+	power(1);
+	configured = 1;
+	glitch = 0;
+	flash_busy = 0;
+	applied = -1;
+	usb_stats = (Usb_stats){0};
+	h = (Sensor_health){0};
+	health_init(&h);
+}
+
+static void loop(const uint32_t period_us)
+{
+	now_us += period_us;
+	calls = 0;
+	health_loop(&h, 0, &img, !flash_busy);
+	CHECK(calls <= 2, "%d sensor calls in one loop", calls); // a step, and the apply after the last
+}
+
+// loops until the sensor is configured again, returns the microseconds
+// from the drop-out, or 0 if it didn't recover within max_us
+static uint64_t outage(const uint32_t period_us, const uint64_t off_us, const uint64_t max_us)
+{
+	const uint64_t at = now_us;
+	power(0);
+	int was_down = 0;
+	while (now_us - at < max_us) {
+		if (powered == 0 && now_us - at >= off_us)
+			power(1);
+		loop(period_us);
+		was_down |= h.down;
+		if (was_down && !h.down && configured)
+			return now_us - at;
+	}
+	return 0;
+}
+
+// longest re-init: both answer polls time out, each step takes a loop at least
+static uint64_t attempt_us(const uint32_t period_us)
+{
+	uint64_t us = 0;
+	for (size_t i = 0; i < sizeof(stage_us) / sizeof(stage_us[0]); i++)
+		us += (stage_us[i] > period_us) ? stage_us[i] : period_us;
+	return us + 2 * 100 * ((PAW3399_POLL_US > period_us) ? PAW3399_POLL_US : period_us);
+}
+
+static void test_healthy(void)
+{
+	boot();
+	for (int i = 0; i < 1000000; i++)
+		loop(125);
+	CHECK(usb_stats.sensor_fails == 0 && !h.down, "a healthy sensor failed");
+
+	// single bad reads are counted, not acted on
+	glitch = HEALTH_FAILS - 1;
+	for (int i = 0; i < 10 * HEALTH_EVERY; i++)
+		loop(125);
+	CHECK(usb_stats.sensor_fails == HEALTH_FAILS - 1, "%u fails", usb_stats.sensor_fails);
+	CHECK(usb_stats.sensor_resets == 0 && !h.down, "re-init after %d bad reads", HEALTH_FAILS - 1);
+}
+
+// off for the detection and extra_us more
+static void test_recover(const uint32_t period_us, const uint64_t extra_us)
+{
+	const uint64_t detect = (uint64_t)(HEALTH_FAILS * HEALTH_EVERY) * period_us;
+	const uint64_t off_us = detect + extra_us;
+	boot();
+	for (int i = 0; i < 5 * HEALTH_EVERY; i++)
+		loop(period_us);
+	const uint64_t us = outage(period_us, off_us, off_us + 10000000);
+	CHECK(us != 0, "%uus loops, %llums off: no recovery", period_us, (unsigned long long)off_us / 1000);
+	if (us == 0)
+		return;
+
+	// the detection is over before power is back. then the re-init under
+	// way finishes or times out, and one more does it.
+	const uint64_t bound = off_us + 2 * attempt_us(period_us);
+	CHECK(us <= bound, "%uus loops, %llums off: recovered after %lluus, more than %lluus",
+			period_us, (unsigned long long)off_us / 1000, (unsigned long long)us, (unsigned long long)bound);
+	CHECK(applied == img.profile, "profile not applied after the re-init");
+	CHECK(usb_stats.sensor_recover_cycles / CYCLES_PER_US <= us, "sensor_recover_cycles longer than the outage");
+	printf("test_health: %4uus loops, %5llums off: recovered after %7.1fms, %6.1fms since detection, %u re-inits\n",
+			period_us, (unsigned long long)off_us / 1000, us / 1000.0,
+			usb_stats.sensor_recover_cycles / CYCLES_PER_US / 1000.0, usb_stats.sensor_resets);
+
+	// and stays up
+	const uint32_t resets = usb_stats.sensor_resets;
+	for (int i = 0; i < 10 * HEALTH_EVERY; i++)
+		loop(period_us);
+	CHECK(usb_stats.sensor_resets == resets && !h.down, "re-init of a healthy sensor");
+}
+
+static void test_flash_busy(void)
+{
+	// no sensor calls from flash while it is busy, the re-init waits
+	boot();
+	power(0);
+	for (int i = 0; i < (HEALTH_FAILS + 1) * HEALTH_EVERY && !h.down; i++)
+		loop(125);
+	CHECK(h.down, "not detected");
+	power(1);
+	const Paw3399_init at = h.init;
+	flash_busy = 1;
+	for (int i = 0; i < 8000; i++) // a sector erase, 1s
+		loop(125);
+	CHECK(h.down && h.init.stage == at.stage, "re-init went on while the flash was busy");
+	flash_busy = 0;
+	for (int i = 0; i < 8000 && h.down; i++)
+		loop(125);
+	CHECK(!h.down && configured, "no recovery after the flash was idle again");
+
+	// nor checks
+	boot();
+	flash_busy = 1;
+	for (int i = 0; i < 4 * HEALTH_EVERY; i++)
+		loop(125);
+	flash_busy = 0;
+	loop(125);
+	CHECK(calls == 1, "the overdue check didn't run when the flash was idle again");
+}
+
+int main(void)
+{
+	test_healthy();
+	const uint64_t extra_ms[] = {0, 10, 100, 2000};
+	for (size_t i = 0; i < sizeof(extra_ms) / sizeof(extra_ms[0]); i++) {
+		test_recover(125, extra_ms[i] * 1000);
+		test_recover(1000, extra_ms[i] * 1000);
+	}
+	test_flash_busy();
+	return test_done("test_health");
+}
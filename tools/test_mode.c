@@ -0,0 +1,340 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// mouse/Src/mode.c on the host: every row of the transition table, reached
+// by button and lift input as on the mouse, with the effects on Config and
+// the animations queued. anim.c and mode.c are included, so the test sees
+// the mode table and the animation queue.
+//
+//   make test_mode && ./test_mode
+
+#include <stdio.h>
+#include "../mouse/Src/anim.c"
+#include "../mouse/Src/mode.c"
+#include "test.h"
+
+// config.c needs the flash, its default is all the test wants from it
+const Config config_default = CONFIG_HS_USB | (1 << CONFIG_LOD_Pos) | (800/50 - 1);
+
+#define LMB 0b01
+#define RMB 0b10
+#define COMBO (LMB | RMB)
+
+static Mode m;
+static Config cfg;
+static uint32_t fx; // or'd since the last check
+
+// one microframe with this input, as loop_once() does it
+static void in(const uint8_t btn, const int lifted)
+{
+	if (mode_changed(&m, btn, lifted))
+		fx |= mode_event(&m, &cfg);
+}
+
+// ticks microframes without a change
+static void hold(const uint32_t ticks)
+{
+	const uint8_t btn = m.in & 0b111;
+	const int lifted = (m.in & MODE_IN_LIFTED) != 0;
+	for (uint32_t i = 0; i < ticks; i++)
+		in(btn, lifted);
+}
+
+static int anim_queued(void)
+{
+	const int n = queue_tail - queue_head;
+	queue_head = queue_tail = 0;
+	len_left = 0;
+	return n;
+}
+
+// into state s the way a user gets there. leaves the input as it was then.
+static void start(const int hs, const Mode_state s)
+{
+	mode_init(&m, hs);
+	cfg = config_default;
+	switch (s) {
+	case MODE_NORMAL:
+		break;
+	case MODE_HOLD1:
+		in(COMBO, 1);
+		break;
+	case MODE_ARMED1_HOLD:
+		start(hs, MODE_HOLD1);
+		hold(m.timeout_ticks);
+		break;
+	case MODE_ARMED1:
+		start(hs, MODE_ARMED1_HOLD);
+		in(LMB, 1);
+		break;
+	case MODE_ARMED2:
+		start(hs, MODE_ARMED1_HOLD);
+		hold(m.timeout_ticks);
+		break;
+	case MODE_DPI:
+		start(hs, MODE_ARMED1);
+		in(0, 0);
+		break;
+	case MODE_DPI_HOLD:
+		start(hs, MODE_DPI);
+		in(COMBO, 1);
+		break;
+	case MODE_LODHZ:
+		start(hs, MODE_ARMED2);
+		in(0, 0);
+		break;
+	case MODE_LODHZ_HOLD:
+		start(hs, MODE_LODHZ);
+		in(COMBO, 1);
+		break;
+	default:
+		break;
+	}
+	CHECK(m.state == s, "start: in %d instead of %d", m.state, s);
+	fx = 0;
+	anim_queued();
+}
+
+#define EXPECT(s, f) do { \
+	CHECK(m.state == (s), "in state %d instead of %d", m.state, (s)); \
+	CHECK(fx == (f), "fx 0x%x instead of 0x%x", fx, (f)); \
+	fx = 0; \
+} while (0)
+
+static uint16_t dpi(void)
+{
+	return _FLD2VAL(CONFIG_DPI, cfg);
+}
+
+// a click while not lifted: press, release
+static void click(const uint8_t b)
+{
+	in(b, 0);
+	in(0, 0);
+}
+
+static void test_table(void)
+{
+	// a zero entry would be a silent move to MODE_NORMAL
+	for (int s = 0; s < MODE_STATE_NUM; s++) {
+		for (int e = 0; e < EV_NUM; e++) {
+			const Mode_transition t = table[s][e];
+			CHECK(t.next == 0xFF || t.next < MODE_STATE_NUM, "state %d event %d: next %d", s, e, t.next);
+			CHECK(!(t.next == MODE_NORMAL && t.act == ACT_NONE), "state %d event %d: zero entry", s, e);
+		}
+	}
+}
+
+static void test_normal(void)
+{
+	// clicks and lifting alone do nothing
+	start(0, MODE_NORMAL);
+	click(LMB);
+	click(RMB);
+	in(0, 1);
+	in(LMB, 1);
+	in(0, 0);
+	EXPECT(MODE_NORMAL, 0);
+	CHECK(m.mask == 0xFFFFFFFF && m.deadline == MODE_NEVER, "normal mode masked or armed");
+
+	// the combo has to be held lifted
+	in(COMBO, 0);
+	EXPECT(MODE_NORMAL, 0);
+	in(COMBO, 1);
+	EXPECT(MODE_HOLD1, 0);
+	CHECK(m.deadline == m.now + m.timeout_ticks, "not armed");
+}
+
+static void test_hold1(void)
+{
+	// let go early
+	start(0, MODE_HOLD1);
+	hold(m.timeout_ticks - 2);
+	in(COMBO, 0); // put down
+	EXPECT(MODE_NORMAL, 0);
+	CHECK(m.deadline == MODE_NEVER, "still armed");
+	CHECK(anim_queued() == 0, "animation without a timeout");
+
+	// hold it to the first timeout
+	start(0, MODE_HOLD1);
+	hold(m.timeout_ticks - 1);
+	EXPECT(MODE_HOLD1, 0);
+	hold(1);
+	EXPECT(MODE_ARMED1_HOLD, 0);
+	CHECK(anim_queued() > 0, "no dpi shown");
+	CHECK(m.mask == 0xFFFFFFFF, "buttons masked before programming");
+}
+
+static void test_armed1(void)
+{
+	// interrupting pauses the count, resuming goes on where it was
+	start(0, MODE_ARMED1_HOLD);
+	hold(1000);
+	in(LMB, 1);
+	EXPECT(MODE_ARMED1, 0);
+	CHECK(m.deadline == MODE_NEVER && m.left == m.timeout_ticks - 1001, "left %u", m.left);
+	hold(20000); // paused, no timeout
+	EXPECT(MODE_ARMED1, 0);
+	in(COMBO, 1);
+	EXPECT(MODE_ARMED1_HOLD, 0);
+	hold(m.timeout_ticks - 1001 - 1);
+	EXPECT(MODE_ARMED1_HOLD, 0);
+	hold(1);
+	EXPECT(MODE_ARMED2, 0);
+	CHECK(anim_queued() > 0, "no lod/hz shown");
+
+	// releasing everything after the first timeout is dpi programming
+	start(0, MODE_ARMED1);
+	in(0, 1);
+	EXPECT(MODE_DPI, 0);
+	CHECK(m.mask == 0xFFFFFFFC, "LMB and RMB not masked in programming");
+
+	// after the second, lod/hz programming
+	start(0, MODE_ARMED2);
+	hold(100000);
+	EXPECT(MODE_ARMED2, 0);
+	in(0, 0);
+	EXPECT(MODE_LODHZ, 0);
+}
+
+static void test_dpi(void)
+{
+	start(0, MODE_DPI);
+	const uint16_t d = dpi();
+	click(RMB);
+	EXPECT(MODE_DPI, MODE_FX_DPI);
+	CHECK(dpi() == d + 1, "dpi %u after up from %u", dpi(), d);
+	CHECK(anim_queued() > 0, "no animation for a step");
+	click(LMB);
+	click(LMB);
+	EXPECT(MODE_DPI, MODE_FX_DPI);
+	CHECK(dpi() == d - 1, "dpi %u after down", dpi());
+
+	// large steps: the other button held, its release is ignored
+	in(RMB, 0);
+	in(LMB | RMB, 0);
+	in(RMB, 0); // LMB up with RMB held
+	EXPECT(MODE_DPI, MODE_FX_DPI);
+	CHECK(dpi() == d - 1 - DPI_LARGE_JUMP, "dpi %u after a large step down", dpi());
+	in(0, 0);
+	CHECK(dpi() == d - 1 - DPI_LARGE_JUMP, "release of the held button stepped");
+	fx = 0;
+
+	// clamped at both ends
+	cfg = (cfg & ~CONFIG_DPI_Msk) | dpi_max;
+	click(RMB);
+	CHECK(dpi() == dpi_max, "above dpi_max");
+	cfg = (cfg & ~CONFIG_DPI_Msk) | dpi_min;
+	click(LMB);
+	CHECK(dpi() == dpi_min, "below dpi_min");
+	fx = 0;
+
+	// lifted clicks don't count
+	start(0, MODE_DPI);
+	in(RMB, 1);
+	in(0, 1);
+	EXPECT(MODE_DPI, 0);
+
+	// hold to save, let go to stay
+	in(COMBO, 1);
+	EXPECT(MODE_DPI_HOLD, 0);
+	in(RMB, 1);
+	EXPECT(MODE_DPI, 0);
+	CHECK(m.deadline == MODE_NEVER, "dpi hold not disarmed");
+	in(COMBO, 1);
+	in(COMBO, 0); // put down: LMB and RMB are not released, so no step
+	EXPECT(MODE_DPI, 0);
+
+	start(0, MODE_DPI_HOLD);
+	in(RMB, 0); // LMB released on the pad while holding
+	EXPECT(MODE_DPI, MODE_FX_DPI); // a step, and the combo is off
+	start(0, MODE_DPI_HOLD);
+	hold(m.timeout_ticks - 1);
+	EXPECT(MODE_DPI_HOLD, 0);
+	hold(1);
+	EXPECT(MODE_NORMAL, MODE_FX_SAVE);
+	CHECK(anim_queued() > 0, "saved dpi not shown");
+	CHECK(m.mask == 0xFFFFFFFF, "buttons still masked");
+}
+
+static void test_lodhz(void)
+{
+	start(1, MODE_LODHZ);
+	const int lod = _FLD2VAL(CONFIG_LOD, cfg);
+	click(LMB);
+	EXPECT(MODE_LODHZ, MODE_FX_LOD);
+	CHECK(_FLD2VAL(CONFIG_LOD, cfg) == (uint32_t)(lod + 1) % 3, "lod not next");
+	click(LMB);
+	click(LMB);
+	fx = 0;
+	CHECK(_FLD2VAL(CONFIG_LOD, cfg) == (uint32_t)lod, "lod doesn't go round");
+
+	// 8k -> 1k -> 2k -> 4k -> 8k
+	const int itv[] = {3, 2, 1, 0};
+	for (int i = 0; i < 4; i++) {
+		click(RMB);
+		EXPECT(MODE_LODHZ, MODE_FX_ITV);
+		CHECK(_FLD2VAL(CONFIG_INTERVAL, cfg) == (uint32_t)itv[i], "interval %u instead of %d",
+				_FLD2VAL(CONFIG_INTERVAL, cfg), itv[i]);
+	}
+
+	// full speed has no interval to change
+	start(0, MODE_LODHZ);
+	click(RMB);
+	EXPECT(MODE_LODHZ, 0);
+
+	start(1, MODE_LODHZ_HOLD);
+	in(LMB, 1);
+	EXPECT(MODE_LODHZ, 0);
+	CHECK(m.deadline == MODE_NEVER, "lod/hz hold not disarmed");
+	start(1, MODE_LODHZ_HOLD);
+	hold(m.timeout_ticks);
+	EXPECT(MODE_NORMAL, MODE_FX_SAVE);
+	CHECK(anim_queued() > 0, "saved lod/hz not shown");
+}
+
+static void test_wrap(void)
+{
+	// arming right before now wraps: the deadline must not become MODE_NEVER
+	mode_init(&m, 1);
+	cfg = config_default;
+	m.now = 0u - m.timeout_ticks - 1; // mode_changed increments first
+	in(COMBO, 1);
+	EXPECT(MODE_HOLD1, 0);
+	CHECK(m.deadline != MODE_NEVER, "deadline is MODE_NEVER");
+	hold(m.timeout_ticks + 1);
+	EXPECT(MODE_ARMED1_HOLD, 0);
+	anim_queued();
+}
+
+int main(void)
+{
+	test_table();
+	test_normal();
+	test_hold1();
+	test_armed1();
+	test_dpi();
+	test_lodhz();
+	test_wrap();
+	return test_done("test_mode");
+}
@@ -0,0 +1,145 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Motion_scale (mouse/Inc/motion.h) over long random traces: after every
+// microframe the summed output equals the exact product of the summed input,
+// rounded to nearest, for any Q2.14 matrix. then the time per scale_apply(),
+// with the portable smlad() on the host, next to a float version.
+//
+//   make test_scale && ./test_scale [microframes]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "motion.h"
+#include "test.h"
+
+// sensor deltas up to ~2k counts per microframe, mostly slow
+static int16_t rnd_delta(void)
+{
+	return (rnd() % 4 == 0) ? (int16_t)(rnd() % 4001) - 2000 : (int16_t)(rnd() % 41) - 20;
+}
+
+static int64_t floor_div(const int64_t a, const int64_t b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static int64_t ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int exact(const int16_t m[2][2], const long n)
+{
+	Motion_scale s;
+	scale_init(&s, 1, m[0][0], m[0][1], m[1][0], m[1][1]);
+	int64_t in_x = 0, in_y = 0; // Q14 products, summed
+	int64_t out_x = 0, out_y = 0;
+	for (long i = 0; i < n; i++) {
+		const int16_t x = rnd_delta(), y = rnd_delta();
+		int32_t dx, dy;
+		scale_apply(&s, PACK16(x, y), &dx, &dy);
+		in_x += (int64_t)x * m[0][0] + (int64_t)y * m[0][1];
+		in_y += (int64_t)x * m[1][0] + (int64_t)y * m[1][1];
+		out_x += dx;
+		out_y += dy;
+		const int64_t half = SCALE_ONE / 2;
+		if (out_x != floor_div(in_x + half, SCALE_ONE) || out_y != floor_div(in_y + half, SCALE_ONE)) {
+			fprintf(stderr, "matrix %d %d %d %d drifts after %ld microframes\n",
+					m[0][0], m[0][1], m[1][0], m[1][1], i + 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const long n = (argc > 1) ? atol(argv[1]) : 10000000; // ~21 minutes at 8kHz
+	rnd_seed(0x2545F4914F6CDD1D);
+
+	// identity, the extremes of the range, and random matrices
+	int16_t m[8][2][2] = {
+		{{SCALE_ONE, 0}, {0, SCALE_ONE}},
+		{{-32768, 32767}, {32767, -32768}},
+		{{SCALE_ONE / 3, 0}, {0, SCALE_ONE * 5 / 3}},
+		{{13377, -9402}, {9402, 13377}}, // ~35 degrees at 1.0
+	};
+	for (int i = 4; i < 8; i++)
+		for (int j = 0; j < 4; j++)
+			m[i][j / 2][j % 2] = (int16_t)rnd();
+	for (int i = 0; i < 8; i++)
+		if (!exact(m[i], n))
+			return 1;
+
+	// identity passes every delta through unchanged
+	Motion_scale s;
+	scale_init(&s, 1, SCALE_ONE, 0, 0, SCALE_ONE);
+	for (int32_t x = -32767; x <= 32767; x++) {
+		int32_t dx, dy;
+		scale_apply(&s, PACK16(x, -x), &dx, &dy);
+		if (dx != x || dy != -x) {
+			fprintf(stderr, "identity changes %d to %d, %d\n", x, dx, dy);
+			return 1;
+		}
+	}
+	printf("test_scale: 8 matrices, %ld microframes each, exact\n", n);
+
+	// the deltas are made up front, so only the scaling is timed
+	enum { BENCH = 1 << 20 };
+	static uint32_t xy[BENCH];
+	for (int i = 0; i < BENCH; i++)
+		xy[i] = PACK16(rnd_delta(), rnd_delta());
+	int64_t sum = 0;
+	int64_t t = ns_now();
+	for (int r = 0; r < 16; r++) {
+		for (int i = 0; i < BENCH; i++) {
+			int32_t dx, dy;
+			scale_apply(&s, xy[i], &dx, &dy);
+			sum += dx + dy;
+		}
+	}
+	const double fixed_ns = (double)(ns_now() - t) / (16.0 * BENCH);
+	const float f[2][2] = {{1.0f, 0}, {0, 1.0f}};
+	float rem_x = 0, rem_y = 0;
+	t = ns_now();
+	for (int r = 0; r < 16; r++) {
+		for (int i = 0; i < BENCH; i++) {
+			const float x = (int16_t)xy[i], y = (int16_t)(xy[i] >> 16);
+			const float tx = f[0][0] * x + f[0][1] * y + rem_x;
+			const float ty = f[1][0] * x + f[1][1] * y + rem_y;
+			const int32_t dx = (int32_t)tx, dy = (int32_t)ty;
+			rem_x = tx - dx;
+			rem_y = ty - dy;
+			sum += dx + dy;
+		}
+	}
+	const double float_ns = (double)(ns_now() - t) / (16.0 * BENCH);
+	printf("test_scale: %.2fns per scale_apply, %.2fns float (%lld)\n",
+			fixed_ns, float_ns, (long long)sum);
+	return 0;
+}
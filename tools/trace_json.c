@@ -0,0 +1,265 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// turns the M3K's event ring (mouse/Inc/trace.h) into a chrome trace, for
+// chrome://tracing or ui.perfetto.dev. needs firmware built with TRACE.
+//
+//   make trace_json
+//
+//   trace_json -a [-o] /dev/hidrawN     clear the ring and record
+//   trace_json [-w dump] /dev/hidrawN > trace.json
+//   trace_json dump > trace.json
+//
+// -a arms the ring, -o with it stops recording when the ring is full instead
+// of keeping the last TRACE_LEN events. reading stops recording. -w keeps the
+// raw report, which is what a dump argument reads back.
+//
+// the main loop is one track, with a slice per microframe from SOF to the
+// end of the loop and the sensor burst and fifo commit inside it. the
+// control bottom half and flash ops get a track each.
+
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRACE_TYPES_ONLY
+#include "trace.h"
+#define USB_TYPES_ONLY
+#include "usb.h"
+
+enum { TID_USB = 1, TID_LOOP, TID_CTRL, TID_FLASH };
+
+static const char *const tid_name[] = {
+	[TID_USB] = "usb",
+	[TID_LOOP] = "main loop",
+	[TID_CTRL] = "control",
+	[TID_FLASH] = "flash",
+};
+
+static int read_dump(const char *path, Trace *t, const char *save)
+{
+	// hidraw needs write access for the feature ioctl, a dump doesn't
+	struct stat st;
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	const int fd = open(path, S_ISCHR(st.st_mode) ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	memset(t, 0, sizeof(*t));
+	ssize_t n;
+	if (S_ISCHR(st.st_mode)) {
+		t->report_id = USB_REPORT_ID_TRACE;
+		n = ioctl(fd, HIDIOCGFEATURE(sizeof(*t)), t);
+	} else {
+		n = read(fd, t, sizeof(*t));
+	}
+	close(fd);
+	if (n < 0 || t->report_id != USB_REPORT_ID_TRACE) {
+		fprintf(stderr, "%s: no trace, is the firmware built with TRACE?\n", path);
+		return -1;
+	}
+	if (n != sizeof(*t)) {
+		fprintf(stderr, "%s: %zd of %zu bytes, a different TRACE_LEN?\n", path, n, sizeof(*t));
+		return -1;
+	}
+	if (save != NULL) {
+		FILE *f = fopen(save, "wb");
+		if (f == NULL || fwrite(t, 1, n, f) != (size_t)n) {
+			perror(save);
+			return -1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+static int arm(const char *path, const int once)
+{
+	const int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	Usb_trace_report r = {.report_id = USB_REPORT_ID_TRACE, .on = 1, .once = once};
+	const int ok = ioctl(fd, HIDIOCSFEATURE(sizeof(r)), &r) >= 0;
+	if (!ok)
+		perror("HIDIOCSFEATURE");
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+static int first = 1;
+
+static void emit(const char *ph, const char *name, const int tid, const double ts, const char *args)
+{
+	printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f%s%s%s}",
+			first ? "" : ",", ph, name, tid, ts,
+			ph[0] == 'i' ? ",\"s\":\"t\"" : "",
+			args != NULL ? ",\"args\":" : "", args != NULL ? args : "");
+	first = 0;
+}
+
+static void decode(const Trace *t)
+{
+	const uint32_t len = t->head < TRACE_LEN ? t->head : TRACE_LEN;
+	const uint32_t oldest = t->head - len;
+	const double per_us = t->cycles_per_us ? t->cycles_per_us : 32;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (int tid = TID_USB; tid <= TID_FLASH; tid++) {
+		char args[64];
+		snprintf(args, sizeof(args), "{\"name\":\"%s\"}", tid_name[tid]);
+		emit("M", "thread_name", tid, 0, args);
+	}
+
+	// cycles wrap every two minutes, the ring spans far less
+	uint64_t now = 0;
+	uint32_t last = len ? t->ev[oldest & (TRACE_LEN - 1)].cycles : 0;
+	int in_loop = 0, in_burst = 0, in_commit = 0, in_ctrl = 0;
+	double sof_ts = -1;
+	uint16_t sof_fn = 0;
+	char args[96];
+	for (uint32_t i = oldest; i != t->head; i++) {
+		const Trace_event *e = &t->ev[i & (TRACE_LEN - 1)];
+		now += (uint32_t)(e->cycles - last);
+		last = e->cycles;
+		const double ts = now / per_us;
+		switch (e->type) {
+		case TRACE_SOF:
+			if (in_loop) // loop end fell out of the ring, or the loop never ended
+				emit("E", "loop", TID_LOOP, ts, NULL);
+			if (sof_ts >= 0) {
+				snprintf(args, sizeof(args), "{\"fn\":%u}", sof_fn);
+				printf(",\n{\"ph\":\"X\",\"name\":\"microframe\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":%s}",
+						TID_USB, sof_ts, ts - sof_ts, args);
+			}
+			sof_ts = ts;
+			sof_fn = e->arg;
+			snprintf(args, sizeof(args), "{\"fn\":%u}", e->arg);
+			emit("B", "loop", TID_LOOP, ts, args);
+			in_loop = 1;
+			break;
+		case TRACE_LOOP_END:
+			if (in_loop)
+				emit("E", "loop", TID_LOOP, ts, NULL);
+			in_loop = 0;
+			break;
+		case TRACE_BURST_BEGIN:
+			emit("B", "sensor burst", TID_LOOP, ts, NULL);
+			in_burst = 1;
+			break;
+		case TRACE_BURST_END:
+			snprintf(args, sizeof(args), "{\"squal\":%u}", e->arg8);
+			if (in_burst)
+				emit("E", "sensor burst", TID_LOOP, ts, args);
+			in_burst = 0;
+			break;
+		case TRACE_COMMIT_BEGIN:
+			emit("B", "fifo commit", TID_LOOP, ts, NULL);
+			in_commit = 1;
+			break;
+		case TRACE_COMMIT_END:
+			if (in_commit)
+				emit("E", "fifo commit", TID_LOOP, ts, NULL);
+			in_commit = 0;
+			break;
+		case TRACE_FLUSH:
+			emit("i", "fifo flush", TID_LOOP, ts, NULL);
+			break;
+		case TRACE_BTN:
+			snprintf(args, sizeof(args), "{\"btn\":\"0x%02x\"}", e->arg8);
+			emit("i", "buttons", TID_LOOP, ts, args);
+			break;
+		case TRACE_WHL:
+			snprintf(args, sizeof(args), "{\"detents\":%d}", (int8_t)e->arg8);
+			emit("i", "wheel", TID_LOOP, ts, args);
+			break;
+		case TRACE_CTRL_BEGIN:
+			snprintf(args, sizeof(args), "{\"gintsts\":\"0x%08x\"}", (uint32_t)e->arg << 4);
+			emit("B", "bottom half", TID_CTRL, ts, args);
+			in_ctrl = 1;
+			break;
+		case TRACE_CTRL_END:
+			if (in_ctrl)
+				emit("E", "bottom half", TID_CTRL, ts, NULL);
+			in_ctrl = 0;
+			break;
+		case TRACE_SETUP:
+			snprintf(args, sizeof(args), "{\"bRequest\":\"0x%02x\",\"wValue\":\"0x%04x\"}", e->arg8, e->arg);
+			emit("i", "setup", TID_CTRL, ts, args);
+			break;
+		case TRACE_FLASH:
+			emit("i", e->arg8 ? "sector erase" : "word program", TID_FLASH, ts, NULL);
+			break;
+		default:
+			snprintf(args, sizeof(args), "{\"type\":%u,\"arg8\":%u,\"arg\":%u}", e->type, e->arg8, e->arg);
+			emit("i", "unknown", TID_LOOP, ts, args);
+		}
+	}
+	printf("\n]}\n");
+	fprintf(stderr, "%u events, %.3fms%s\n", len, now / per_us / 1000,
+			t->head > TRACE_LEN ? ", older ones were overwritten" : "");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: trace_json -a [-o] /dev/hidrawN\n"
+			"       trace_json [-w dump] /dev/hidrawN|dump > trace.json\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int do_arm = 0, once = 0;
+	const char *save = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "aow:")) != -1) {
+		switch (opt) {
+		case 'a': do_arm = 1; break;
+		case 'o': once = 1; break;
+		case 'w': save = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || (once && !do_arm))
+		usage();
+	if (do_arm)
+		return arm(argv[optind], once) < 0;
+
+	static Trace t;
+	if (read_dump(argv[optind], &t, save) < 0)
+		return 1;
+	decode(&t);
+	return 0;
+}
@@ -0,0 +1,303 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Zaunkoenig GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// runs the firmware's report pipeline (mouse/Inc/report.h) on a pc and hands
+// the reports to the kernel through /dev/uhid, with the same report
+// descriptor as the mouse. the kernel binds hid-generic to it like to the
+// real thing, so the host input stack can be measured at every report rate
+// without hardware, e.g. with evdev_rate on the event node it gets.
+//
+//   cc -O2 -I../mouse/Inc -o uhid_bridge uhid_bridge.c
+//
+//   uhid_bridge [-f] [-i interval] [-t secs] [-m dx,dy] [-b ms] [-w ms] [-d n]
+//
+// -f full speed (1kHz loop), otherwise a 125us microframe loop like
+//    high speed
+// -i CONFIG_INTERVAL, 0..3 for 8k/4k/2k/1k, high speed only
+// -m sensor counts per loop, the direction turns around every second.
+//    default 1,0
+// -b toggle LMB every ms
+// -w one wheel detent every ms
+// -d the host doesn't collect every nth report, which the firmware finds
+//    still in the fifo a loop later, flushes and sends again
+//
+// the sensor, buttons and wheel are stubs that follow these patterns, the
+// rest of loop_once() (sensor health, lift, scale and curve, mode
+// processing) isn't run.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "report.h"
+
+#define M3K_USB_VID 0x0483 // as in m3k_resource.h
+#define M3K_USB_PID 0xA462
+#define HID_EPIN_SIZE 6 // as in usbd_hid.h, the report without its padding
+
+static const uint8_t report_desc[] = HID_MOUSE_REPORT_DESC;
+static_assert(sizeof(report_desc) == 69, "HID_MOUSE_REPORT_DESC_SIZE");
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int uhid_write(const int fd, const struct uhid_event *ev)
+{
+	if (write(fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		perror("uhid write");
+		return -1;
+	}
+	return 0;
+}
+
+static int uhid_create(const int fd)
+{
+	struct uhid_event ev = {.type = UHID_CREATE2};
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "M3K uhid bridge");
+	memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+	ev.u.create2.rd_size = sizeof(report_desc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = M3K_USB_VID;
+	ev.u.create2.product = M3K_USB_PID;
+	return uhid_write(fd, &ev);
+}
+
+// returns 1 while the kernel has the device started
+static int uhid_poll(const int fd, int started)
+{
+	struct uhid_event ev;
+	while (read(fd, &ev, sizeof(ev)) > 0) {
+		switch (ev.type) {
+		case UHID_START: started = 1; break;
+		case UHID_STOP: started = 0; break;
+		case UHID_GET_REPORT: // there are no feature reports on this interface
+			uhid_write(fd, &(struct uhid_event){.type = UHID_GET_REPORT_REPLY,
+					.u.get_report_reply = {.id = ev.u.get_report.id, .err = EIO}});
+			break;
+		case UHID_SET_REPORT:
+			uhid_write(fd, &(struct uhid_event){.type = UHID_SET_REPORT_REPLY,
+					.u.set_report_reply = {.id = ev.u.set_report.id, .err = EIO}});
+			break;
+		}
+	}
+	return started;
+}
+
+typedef struct {
+	int dx, dy; // per loop
+	int btn_loops; // LMB toggles, 0 for never
+	int whl_loops; // detent every, 0 for never
+	int hold_loops; // each wheel phase lasts this long
+	int turn_loops; // motion turns around
+} Pattern;
+
+typedef struct {
+	uint64_t loops, sent, skipped, flushed, late;
+} Stats;
+
+// the stubbed inputs for loop n
+static void pattern_motion(const Pattern *p, const uint64_t n, Usb_packet *new)
+{
+	const int sign = (n / p->turn_loops) & 1 ? -1 : 1;
+	new->x = (int16_t)(sign * p->dx);
+	new->y = (int16_t)(sign * p->dy);
+}
+
+// btn_read(), NO and NC active low
+static uint16_t pattern_btn(const Pattern *p, const uint64_t n)
+{
+	const int lmb = p->btn_loops > 0 && (n / p->btn_loops) & 1;
+	const uint8_t no = lmb ? 0b110 : 0b111;
+	const uint8_t nc = lmb ? 0b001 : 0b000;
+	return (nc << 8) | no;
+}
+
+// whl_read(), 0 or 3 at rest, a detent passes 2 or 1 in between
+static int pattern_whl(const Pattern *p, const uint64_t n)
+{
+	if (p->whl_loops == 0)
+		return 3;
+	const uint64_t detent = n / p->whl_loops, at = n % p->whl_loops;
+	const int from = (detent & 1) ? 0 : 3; // where the last detent ended
+	if (at < (uint64_t)p->hold_loops)
+		return from;
+	if (at < 2 * (uint64_t)p->hold_loops)
+		return from == 3 ? 2 : 1; // turning up, see whl_decode
+	return 3 - from;
+}
+
+static int64_t ns_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: uhid_bridge [-f] [-i interval] [-t secs] [-m dx,dy] [-b ms] [-w ms] [-d n]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int hs_usb = 1, interval = 0, drop = 0;
+	double secs = 0;
+	int btn_ms = 0, whl_ms = 0;
+	Pattern pat = {.dx = 1};
+	int opt;
+	while ((opt = getopt(argc, argv, "fi:t:m:b:w:d:")) != -1) {
+		switch (opt) {
+		case 'f': hs_usb = 0; break;
+		case 'i': interval = atoi(optarg); break;
+		case 't': secs = atof(optarg); break;
+		case 'm': if (sscanf(optarg, "%d,%d", &pat.dx, &pat.dy) != 2) usage(); break;
+		case 'b': btn_ms = atoi(optarg); break;
+		case 'w': whl_ms = atoi(optarg); break;
+		case 'd': drop = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (interval < 0 || interval > 3 || optind != argc)
+		usage();
+
+	// as main() sets up the loop
+	const int loops_per_ms = hs_usb ? 8 : 1;
+	const int skip = hs_usb ? (1 << interval) - 1 : 0;
+	const int64_t period = 1000000 / loops_per_ms;
+	pat.turn_loops = 1000 * loops_per_ms;
+	pat.btn_loops = btn_ms * loops_per_ms;
+	pat.whl_loops = whl_ms * loops_per_ms;
+	pat.hold_loops = loops_per_ms; // 1ms, the wheel is only read every 4 microframes
+	if (pat.whl_loops > 0 && pat.whl_loops < 3 * pat.hold_loops)
+		usage();
+
+	const int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+	if (uhid_create(fd) < 0)
+		return 1;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	struct sched_param sp = {.sched_priority = sched_get_priority_max(SCHED_FIFO)};
+	sched_setscheduler(0, SCHED_FIFO, &sp); // best effort
+
+	// wait for hid-generic to bind
+	int started = 0;
+	for (int i = 0; i < 100 && !started && !stop; i++) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		poll(&pfd, 1, 20);
+		started = uhid_poll(fd, started);
+	}
+	if (!started) {
+		fprintf(stderr, "the kernel didn't start the device\n");
+		return 1;
+	}
+	fprintf(stderr, "M3K uhid bridge at %dHz, see /proc/bus/input/devices for its event node\n",
+			loops_per_ms * 1000 / (skip + 1));
+
+	// the report state of Loop in main.c
+	int count = 0;
+	uint8_t btn_prev = 0;
+	Whl_state whl = {.lastlast = pattern_whl(&pat, 0)};
+	whl.last = whl.lastlast;
+	Usb_packet new = {0}, send = {0};
+	Motion_acc acc = {0};
+	int in_fifo = 0; // last report not collected
+	Stats st = {0};
+
+	const int64_t start = ns_now();
+	const int64_t end = secs > 0 ? start + (int64_t)(secs * 1e9) : INT64_MAX;
+	int64_t next = start;
+	uint64_t n = 0;
+	while (!stop && next < end) {
+		// the SOF. a loop that comes too late misses microframes, as on the mouse
+		next += period;
+		const struct timespec ts = {.tv_sec = next / 1000000000LL, .tv_nsec = next % 1000000000LL};
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		const int64_t behind = ns_now() - next;
+		if (behind >= period) {
+			st.late++;
+			next += behind / period * period;
+			n += behind / period;
+		}
+		started = uhid_poll(fd, started);
+		st.loops++;
+		n++;
+
+		// sensor, wheel, buttons, as in loop_once()
+		pattern_motion(&pat, n, &new);
+		new.whl = whl_due(&whl, hs_usb) ? whl_decode(&whl, pattern_whl(&pat, n)) : 0;
+		btn_prev = new.btn;
+		new.btn = btn_latch(pattern_btn(&pat, n), btn_prev);
+		acc_add(&acc, new.x, new.y, new.whl);
+
+		int resend = 0;
+		if (in_fifo) {
+			in_fifo = 0;
+			count = 0;
+			report_requeue(&acc, &send);
+			resend = 1;
+			st.flushed++;
+		}
+
+		const int r = report_next(&count, skip, &send, &acc, new.btn, resend);
+		if (r == REPORT_HELD) {
+			st.skipped++;
+		} else if (r == REPORT_SEND) {
+			st.sent++;
+			if (drop > 0 && st.sent % drop == 0) {
+				in_fifo = 1;
+				continue;
+			}
+			struct uhid_event ev = {.type = UHID_INPUT2};
+			ev.u.input2.size = HID_EPIN_SIZE;
+			memcpy(ev.u.input2.data, send.u8, HID_EPIN_SIZE);
+			if (started && uhid_write(fd, &ev) < 0)
+				break;
+		}
+	}
+
+	const double t = (ns_now() - start) / 1e9;
+	fprintf(stderr, "%.3fs: %lu loops, %lu sent (%.1fHz), %lu skipped, %lu flushed, %lu late\n",
+			t, (unsigned long)st.loops, (unsigned long)st.sent, st.sent / t,
+			(unsigned long)st.skipped, (unsigned long)st.flushed, (unsigned long)st.late);
+	uhid_write(fd, &(struct uhid_event){.type = UHID_DESTROY});
+	close(fd);
+	return 0;
+}